@@ -36,49 +36,402 @@ void notimpl()
 exception::exception() throw()  { }
 exception::~exception() throw()  { }
 
+// MurmurHash3-style mixing, 8 bytes per iteration, with the 64-bit
+// finalizer; unaligned reads are done via memcpy() which compiles to a
+// single load on platforms that allow it
+
+static inline ularge _rotl64(ularge x, int r)
+    { return (x << r) | (x >> (64 - r)); }
+
+static inline ularge _fmix64(ularge h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb93fe1a85a53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+hashint memhash(const void* p, memint len)
+{
+    const ularge C1 = 0x87c37b91114253d5ULL;
+    const ularge C2 = 0x4cf5ad432745937fULL;
+    const uchar* b = (const uchar*)p;
+    ularge h = 0x9e3779b97f4a7c15ULL ^ ularge(len);
+    for ( ; len >= 8; len -= 8, b += 8)
+    {
+        ularge k;
+        ::memcpy(&k, b, 8);
+        h ^= _rotl64(k * C1, 31) * C2;
+        h = _rotl64(h, 27) * 5 + 0x52dce729;
+    }
+    if (len > 0)
+    {
+        ularge k = 0;
+        ::memcpy(&k, b, len);
+        h ^= _rotl64(k * C1, 31) * C2;
+    }
+    h = _fmix64(h);
+    return hashint(h ^ (h >> 32));
+}
+
+
+hashint inthash(ularge v)
+{
+    ularge h = _fmix64(v);
+    return hashint(h ^ (h >> 32));
+}
+
+
 void outofmemory()
 {
     fatal(0x0001, "Out of memory");
 }
 
-static void newdel()
+// --- Pool allocator ------------------------------------------------------ //
+
+
+#ifdef SHN_POOL
+
+enum
 {
-    fatal(0x0002, "Global new/delete are disabled");
-}
+    POOL_GRAN = 16,
+    POOL_CLASSES = 64,
+    PMEM_POOL_MAX = POOL_GRAN * POOL_CLASSES,
+    POOL_SLAB = 32768,
+    POOL_ARENA = POOL_CLASSES + 1,  // class of arena blocks
+    ARENA_SLAB = 65536,
+    ARENA_MAX = ARENA_SLAB / 8      // bigger blocks go to the pools
+};
 
-void* operator new(size_t) throw()       { newdel(); return NULL; }
-void* operator new[](size_t) throw()     { newdel(); return NULL; }
-void  operator delete  (void*) throw()   { newdel(); }
-void  operator delete[](void*) throw()   { newdel(); }
 
+struct poolcache;
 
+
+// Each block is preceded by its size class, 0 for malloc'ed blocks. The
+// header is one word, same as malloc's own overhead on most systems, which
+// also means blocks are aligned to a word and not to malloc's 16 bytes (see
+// pmemalloc() in common.h). In multithreaded builds it also holds the cache
+// the block belongs to.
+struct poolhdr
+{
+    memint cls;
 #ifdef SHN_THR
+    poolcache* owner;  // also used as a link in the remote free list
+#endif
+};
 
-#if defined(__GNUC__) && (defined(__i386__) || defined(__I386__)|| defined(__x86_64__))
-// multi-threaded version with GCC on i386
+struct poolclass
+{
+    char* free;     // linked via the first word of each free block
+    memint live;
+    memint peak;
+};
 
 
-atomicint pincrement(atomicint* target) throw()
+// In multithreaded builds each thread has its own cache. A block released
+// by a thread other than its owner is pushed onto the owner's lock-free
+// 'remote' list, which the owner drains when it runs out of blocks of some
+// class. Caches are never destroyed, since blocks owned by a finished
+// thread can still be released by others.
+struct poolcache
 {
-    atomicint temp = 1;
-    __asm__ __volatile ("lock ; xaddl %0,(%1)" : "+r" (temp) : "r" (target));
-    return temp + 1;
+    poolclass classes[POOL_CLASSES + 1];  // [0] is for big blocks
+#ifdef SHN_THR
+    poolhdr* remote;
+#endif
+};
+
+
+#ifdef SHN_THR
+
+static __thread poolcache* _thrcache;
+
+static poolcache* pool_cache()
+{
+    if (_thrcache == NULL)
+        _thrcache = (poolcache*)pmemcheck(::calloc(1, sizeof(poolcache)));
+    return _thrcache;
 }
 
 
-atomicint pdecrement(atomicint* target) throw()
+static void pool_remote_free(poolcache* owner, poolhdr* h)
 {
-    atomicint temp = -1;
-    __asm__ __volatile ("lock ; xaddl %0,(%1)" : "+r" (temp) : "r" (target));
-    return temp - 1;
+    poolhdr* head;
+    do
+    {
+        head = pload(&owner->remote);
+        h->owner = (poolcache*)head;
+    }
+    while (!pcompareexchange(&owner->remote, head, h));
 }
 
 
+static void pool_drain(poolcache* cache)
+{
+    // Take the whole list at once, so that there's no ABA problem
+    poolhdr* h = pexchange(&cache->remote, (poolhdr*)NULL);
+    while (h != NULL)
+    {
+        poolhdr* next = (poolhdr*)h->owner;
+        poolclass& pc = cache->classes[h->cls];
+        pc.live--;
+        *(char**)h = pc.free;
+        pc.free = (char*)h;
+        h = next;
+    }
+}
+
 #else
 
-#error Undefined architecture: atomic functions are not available
+static poolcache _cache;
+
+static inline poolcache* pool_cache()
+    { return &_cache; }
 
 #endif
 
+
+static inline memint pool_class(memint s)
+{
+    memint c = (s + memint(sizeof(poolhdr)) + POOL_GRAN - 1) / POOL_GRAN;
+    return c > POOL_CLASSES ? 0 : c;
+}
+
+
+static inline memint pool_usable(memint c)
+    { return c * POOL_GRAN - memint(sizeof(poolhdr)); }
+
+
+static char* pool_refill(memint c)
+{
+    memint bsize = c * POOL_GRAN;
+    memint count = POOL_SLAB / bsize;
+    char* slab = (char*)pmemcheck(::malloc(count * bsize));
+    char* last = slab + (count - 1) * bsize;
+    for (char* b = slab; b < last; b += bsize)
+        *(char**)b = b + bsize;
+    *(char**)last = NULL;
+    return slab;
+}
+
+
+void* pmemalloc(memint s)
+{
+    memint c = pool_class(s);
+    poolcache* cache = pool_cache();
+    poolclass& pc = cache->classes[c];
+    poolhdr* h;
+    if (c == 0)
+        h = (poolhdr*)pmemcheck(::malloc(sizeof(poolhdr) + s));
+    else
+    {
+#ifdef SHN_THR
+        if (pc.free == NULL && pload(&cache->remote) != NULL)
+            pool_drain(cache);
 #endif
+        if (pc.free == NULL)
+            pc.free = pool_refill(c);
+        h = (poolhdr*)pc.free;
+        pc.free = *(char**)pc.free;
+    }
+    h->cls = c;
+#ifdef SHN_THR
+    h->owner = cache;
+#endif
+    if (++pc.live > pc.peak)
+        pc.peak = pc.live;
+    return h + 1;
+}
+
+
+void* pmemcalloc(memint s)
+    { return ::memset(pmemalloc(s), 0, s); }
+
+
+static void arena_release(pmemarena*);
+
+
+void pmemfree(void* p)
+{
+    if (p == NULL)
+        return;
+    poolhdr* h = (poolhdr*)p - 1;
+    memint c = h->cls;
+    assert(c >= 0 && c <= POOL_ARENA);
+    if (c == POOL_ARENA)
+    {
+        arena_release(*((pmemarena**)h - 1));
+        return;
+    }
+    poolcache* cache = pool_cache();
+    if (c == 0)
+    {
+        // Big blocks are counted against the releasing thread
+        cache->classes[0].live--;
+        ::free(h);
+        return;
+    }
+#ifdef SHN_THR
+    if (h->owner != cache)
+    {
+        pool_remote_free(h->owner, h);
+        return;
+    }
+#endif
+    poolclass& pc = cache->classes[c];
+    pc.live--;
+    *(char**)h = pc.free;
+    pc.free = (char*)h;
+}
+
+
+void* pmemrealloc(void* p, memint s)
+{
+    if (p == NULL)
+        return pmemalloc(s);
+    poolhdr* h = (poolhdr*)p - 1;
+    memint c = h->cls;
+    assert(c != POOL_ARENA);
+    memint nc = pool_class(s);
+    if (c == 0 && nc == 0)
+        return (poolhdr*)pmemcheck(::realloc(h, sizeof(poolhdr) + s)) + 1;
+    if (c != 0 && s <= pool_usable(c))
+        return p;
+    // Moving between classes: a big block can only shrink here, so the
+    // new size is always the smaller one in that case
+    void* n = pmemalloc(s);
+    ::memcpy(n, p, c == 0 ? s : imin(s, pool_usable(c)));
+    pmemfree(p);
+    return n;
+}
+
+
+// Slabs are linked via their first word. The arena itself holds one
+// reference to 'live' until closed, so that whoever drops the count to zero,
+// pmemarena_close() or pmemfree(), returns the slabs.
+struct pmemarena
+{
+    char* slabs;
+    char* cur;
+    char* end;
+    atomicint live;
+};
+
+
+// An arena block is preceded by its arena and a regular header with the
+// POOL_ARENA class
+struct arenahdr
+{
+    pmemarena* arena;
+    poolhdr hdr;
+};
+
+
+#ifdef SHN_THR
+static __thread pmemarena* _curarena;
+#else
+static pmemarena* _curarena;
+#endif
+
+
+pmemarena* pmemarena_new()
+{
+    pmemarena* a = (pmemarena*)pmemcheck(::calloc(1, sizeof(pmemarena)));
+    a->live = 1;
+    return a;
+}
+
+
+static void arena_release(pmemarena* a)
+{
+    if (pdecrement(&a->live) == 0)
+    {
+        while (a->slabs != NULL)
+        {
+            char* next = *(char**)a->slabs;
+            ::free(a->slabs);
+            a->slabs = next;
+        }
+        ::free(a);
+    }
+}
+
+
+void pmemarena_close(pmemarena* a)
+{
+    if (a != NULL)
+    {
+        assert(a != _curarena);
+        arena_release(a);
+    }
+}
+
+
+pmemarena* pmemarena_swap(pmemarena* a)
+{
+    pmemarena* prev = _curarena;
+    _curarena = a;
+    return prev;
+}
+
+
+void* pmemarena_alloc(memint s)
+{
+    pmemarena* a = _curarena;
+    if (a == NULL || s > ARENA_MAX)
+        return pmemalloc(s);
+    const memint align = memint(sizeof(void*));
+    memint bsize = (memint(sizeof(arenahdr)) + s + align - 1) & ~(align - 1);
+    if (a->end - a->cur < bsize)
+    {
+        char* slab = (char*)pmemcheck(::malloc(ARENA_SLAB));
+        *(char**)slab = a->slabs;
+        a->slabs = slab;
+        a->cur = slab + align;
+        a->end = slab + ARENA_SLAB;
+    }
+    arenahdr* h = (arenahdr*)a->cur;
+    a->cur += bsize;
+    h->arena = a;
+    h->hdr.cls = POOL_ARENA;
+#ifdef SHN_THR
+    h->hdr.owner = NULL;
+#endif
+    pincrement(&a->live);
+    return h + 1;
+}
+
+
+void pmemstats(FILE* f)
+{
+    // Statistics of the calling thread
+    poolclass* pools = pool_cache()->classes;
+    fprintf(f, "%8s %10s %10s\n", "size", "live", "peak");
+    for (memint c = 1; c <= POOL_CLASSES; c++)
+        if (pools[c].peak > 0)
+            fprintf(f, "%8ld %10ld %10ld\n", long(pool_usable(c)),
+                long(pools[c].live), long(pools[c].peak));
+    fprintf(f, "%8s %10ld %10ld\n", "big", long(pools[0].live), long(pools[0].peak));
+}
+
+#else // SHN_POOL
+
+void pmemstats(FILE*)
+    { }
+
+#endif // SHN_POOL
+
+
+static void newdel()
+{
+    fatal(0x0002, "Global new/delete are disabled");
+}
+
+void* operator new(size_t) throw()       { newdel(); return NULL; }
+void* operator new[](size_t) throw()     { newdel(); return NULL; }
+void  operator delete  (void*) throw()   { newdel(); }
+void  operator delete[](void*) throw()   { newdel(); }
 
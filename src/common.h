@@ -19,6 +19,9 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <dlfcn.h>
+#ifdef SHN_THR
+#  include <pthread.h>
+#endif
 
 #include "version.h"
 
@@ -37,6 +40,20 @@
 // #define SHN_FASTER
 
 
+// Pack the `variant' structure to 4-byte alignment: 12 bytes instead of 16
+// on 64-bit systems, at the cost of misaligned 8-byte loads; these are
+// cheap on x86 and ARMv8 but may trap elsewhere.
+// #define SHN_PACKVAR
+
+
+// Small memory blocks are allocated from size-class pools (see pmemalloc()),
+// per thread in multithreaded builds; disabled with SHN_NOPOOL, e.g. when
+// debugging with external memory checkers
+#if !defined(SHN_NOPOOL)
+#  define SHN_POOL
+#endif
+
+
 #define SOURCE_EXT ".shn"
 
 
@@ -65,6 +82,9 @@ typedef size_t umemint;
 typedef int16_t jumpoffs;
 #define MEMINT_MAX LONG_MAX
 
+// Hash values are 32-bit on all platforms so that they can be cached compactly
+typedef uint32_t hashint;
+
 // Convenient aliases
 typedef unsigned char uchar;
 typedef long long large;
@@ -130,11 +150,33 @@ struct exception
 inline memint pstrlen(const char* s)
     { return s == NULL ? 0 : ::strlen(s); }
 
+// Fast non-cryptographic hashing; hash values are not portable across
+// platforms with different endianness, so they should never be stored
+hashint memhash(const void*, memint);
+hashint inthash(ularge);
+inline hashint hashmix(hashint h, hashint v)
+    { return h ^ (v + 0x9e3779b9 + (h << 6) + (h >> 2)); }
+
 void outofmemory();
 
 inline void* pmemcheck(void* p)
     { if (p == NULL) outofmemory(); return p; }
 
+#ifdef SHN_POOL
+
+// Blocks of up to PMEM_POOL_MAX bytes are served from per-size-class free
+// lists, with 16-byte granularity; bigger ones go to malloc(). Pool memory is
+// never returned to the system but is reused for blocks of the same class.
+// Blocks, including arena ones, are only aligned to sizeof(void*), not to
+// malloc()'s 16 bytes: don't use them for types that need more, like SSE
+// vectors loaded with aligned instructions or long double.
+void* pmemalloc(memint s);
+void* pmemcalloc(memint s);
+void* pmemrealloc(void* p, memint s);
+void pmemfree(void* p);
+
+#else
+
 inline void* pmemalloc(memint s)
     { return pmemcheck(::malloc(s)); }
 
@@ -147,6 +189,45 @@ inline void* pmemrealloc(void* p, memint s)
 inline void pmemfree(void* p)
     { ::free(p); }
 
+#endif
+
+// Per-size-class live and peak block counts, empty if pools are disabled
+void pmemstats(FILE*);
+
+
+// Arenas: while an arena is current (per thread), pmemarena_alloc() bump-
+// allocates from its slabs. Blocks are released with pmemfree() as usual but
+// the memory is only returned, all at once, after the arena is closed and its
+// last block is freed. Arena blocks can't be reallocated. Without pools
+// arenas are disabled and pmemarena_alloc() is the same as pmemalloc().
+struct pmemarena;
+
+#ifdef SHN_POOL
+
+pmemarena* pmemarena_new();
+void pmemarena_close(pmemarena*);
+pmemarena* pmemarena_swap(pmemarena*);  // returns the previous one
+void* pmemarena_alloc(memint s);
+
+#else
+
+inline pmemarena* pmemarena_new()               { return NULL; }
+inline void pmemarena_close(pmemarena*)         { }
+inline pmemarena* pmemarena_swap(pmemarena*)    { return NULL; }
+inline void* pmemarena_alloc(memint s)          { return pmemalloc(s); }
+
+#endif
+
+
+// Makes an arena current within a scope, exception-safe
+class arenascope: noncopyable
+{
+    pmemarena* save;
+public:
+    arenascope(pmemarena* a) throw(): save(pmemarena_swap(a))  { }
+    ~arenascope() throw()                               { pmemarena_swap(save); }
+};
+
 
 // Default placement versions of new and delete
 inline void* operator new(size_t, void* p) throw() { return p; }
@@ -162,16 +243,61 @@ void  operator delete[](void*) throw();
 // --- ATOMIC OPERATIONS -------------------------------------------------- //
 
 
-typedef int atomicint;
+// Object refcounts are 32-bit so that the object header remains two words on
+// 64-bit platforms; the functions below work on any integer type though,
+// including 64-bit counters (large, memint). Load, CAS and exchange work on
+// pointers too. In multithreaded builds all operations are sequentially
+// consistent, i.e. are also full memory barriers. Requires GCC 4.7 or later
+// or Clang, on any architecture they support.
 
-// TODO: the atomic functions below should be 64-bit on a 64-bit platform
+typedef int atomicint;
 
 #ifndef SHN_THR
-    inline atomicint pincrement(atomicint* target) throw() { return ++(*target); }
-    inline atomicint pdecrement(atomicint* target) throw() { return --(*target); }
+
+template <class T>
+    inline T pload(const T* target) throw()  { return *target; }
+template <class T>
+    inline T pincrement(T* target) throw()  { return ++(*target); }
+template <class T>
+    inline T pdecrement(T* target) throw()  { return --(*target); }
+template <class T>
+    inline T padd(T* target, T value) throw()  { return *target += value; }
+template <class T>
+    inline T pexchange(T* target, T value) throw()
+        { T t = *target; *target = value; return t; }
+template <class T>
+    inline bool pcompareexchange(T* target, T expected, T value) throw()
+        { if (*target != expected) return false; *target = value; return true; }
+inline void pfence() throw()  { }
+
+#elif defined(__GNUC__)
+
+template <class T>
+    inline T pload(const T* target) throw()
+        { return __atomic_load_n(target, __ATOMIC_SEQ_CST); }
+template <class T>
+    inline T pincrement(T* target) throw()
+        { return __atomic_add_fetch(target, 1, __ATOMIC_SEQ_CST); }
+template <class T>
+    inline T pdecrement(T* target) throw()
+        { return __atomic_sub_fetch(target, 1, __ATOMIC_SEQ_CST); }
+template <class T>
+    inline T padd(T* target, T value) throw()
+        { return __atomic_add_fetch(target, value, __ATOMIC_SEQ_CST); }
+template <class T>
+    inline T pexchange(T* target, T value) throw()
+        { return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+template <class T>
+    inline bool pcompareexchange(T* target, T expected, T value) throw()
+        { return __atomic_compare_exchange_n(target, &expected, value, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+inline void pfence() throw()
+    { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
 #else
-    atomicint pincrement(atomicint* target) throw();
-    atomicint pdecrement(atomicint* target) throw();
+
+#  error Undefined compiler: atomic functions are not available
+
 #endif
 
 
@@ -39,15 +39,121 @@ static void test_common()
     int i = 1;
     check(pincrement(&i) == 2);
     check(pdecrement(&i) == 1);
+    large l = 0x7fffffffLL;
+    check(pincrement(&l) == 0x80000000LL);
+    check(padd(&l, large(0x100000000LL)) == 0x180000000LL);
+    check(pexchange(&l, large(5)) == 0x180000000LL && l == 5);
+    check(!pcompareexchange(&l, large(4), large(6)) && l == 5);
+    check(pcompareexchange(&l, large(5), large(6)) && pload(&l) == 6);
+    int* ip = &i;
+    check(pexchange(&ip, (int*)NULL) == &i && ip == NULL);
+    pfence();
+
+    // allocator, small and big blocks, moving between classes
+    char* p1 = (char*)pmemalloc(10);
+    char* p2 = (char*)pmemcalloc(100);
+    check(p2[0] == 0 && p2[99] == 0);
+    memcpy(p1, "0123456789", 10);
+    p1 = (char*)pmemrealloc(p1, 12);
+    check(memcmp(p1, "0123456789", 10) == 0);
+    p1 = (char*)pmemrealloc(p1, 5000);
+    check(memcmp(p1, "0123456789", 10) == 0);
+    p1 = (char*)pmemrealloc(p1, 300);
+    check(memcmp(p1, "0123456789", 10) == 0);
+    p1 = (char*)pmemrealloc(p1, 4);
+    check(memcmp(p1, "0123", 4) == 0);
+    check(memint(p1) % sizeof(void*) == 0 && memint(p2) % sizeof(void*) == 0);
+    pmemfree(p2);
+    char* p3 = (char*)pmemalloc(100);
+    pmemfree(p3);
+    pmemfree(p1);
+    pmemfree(NULL);
 }
 
 
+#ifdef SHN_THR
+
+// Blocks allocated by one thread and released by another should end up
+// back in the owner's cache
+
+enum { THR_BLOCKS = 2000 };
+
+static void* thr_free_blocks(void* arg)
+{
+    void** blocks = (void**)arg;
+    for (int i = 0; i < THR_BLOCKS; i++)
+        pmemfree(blocks[i]);
+    return NULL;
+}
+
+
+static void test_thr_alloc()
+{
+    static void* blocks[THR_BLOCKS];
+    for (int i = 0; i < THR_BLOCKS; i++)
+        blocks[i] = pmemalloc(24);
+    pthread_t t;
+    check(pthread_create(&t, NULL, thr_free_blocks, blocks) == 0);
+    check(pthread_join(t, NULL) == 0);
+    bool reused = false;
+    void* more[THR_BLOCKS];
+    for (int i = 0; i < THR_BLOCKS; i++)
+    {
+        more[i] = pmemalloc(24);
+        for (int j = 0; j < THR_BLOCKS && !reused; j++)
+            reused = more[i] == blocks[j];
+    }
+    check(reused);
+    for (int i = 0; i < THR_BLOCKS; i++)
+        pmemfree(more[i]);
+}
+
+
+// A shared object can be copied and released concurrently
+
+static void* thr_copy_var(void* arg)
+{
+    const variant& v = *(const variant*)arg;
+    for (int i = 0; i < THR_BLOCKS; i++)
+        variant t = v;
+    return NULL;
+}
+
+
+static void test_thr_share()
+{
+    varvec vv;
+    vv.push_back("abc");
+    vv.push_back(varvec());
+    variant v = vv;
+    vv.clear();
+    check(!v.as_anyobj()->isshared());
+    v.share();
+    check(v.as_anyobj()->isshared());
+    check(v.as_vec()[0].as_anyobj()->isshared());
+    pthread_t t;
+    check(pthread_create(&t, NULL, thr_copy_var, &v) == 0);
+    for (int i = 0; i < THR_BLOCKS; i++)
+        variant t = v;
+    check(pthread_join(t, NULL) == 0);
+    check(v.as_anyobj()->isunique());
+}
+
+#endif
+
+
 struct testobj: public object
 {
     testobj()  { }
 };
 
 
+struct arenaobj: public object
+{
+    void* operator new(size_t s)    { return _arena_new(s); }
+};
+
+
 static void test_object()
 {
     {
@@ -61,6 +167,69 @@ static void test_object()
         b = (new testobj())->grab();
         b->release();
     }
+    {
+        // objects allocated in an arena, one outliving the arena's scope;
+        // only classes that ask for it use the arena
+        pmemarena* a = pmemarena_new();
+        objptr<object> p1, p2, p4;
+        {
+            arenascope scope(a);
+            p1 = new arenaobj();
+            p2 = new arenaobj();
+            p4 = new testobj();
+            check(memint(p2.get()) % sizeof(void*) == 0);
+            void* big = pmemarena_alloc(100000);  // too big, from the pools
+            check(big != NULL);
+            pmemfree(big);
+        }
+        objptr<object> p3 = new testobj();
+        check(p1.get() != p2.get() && p3.get() != p1.get());
+        p1 = NULL;
+        pmemarena_close(a);
+        check(p2->isunique());
+    }
+    {
+        // deferred destruction: a long chain is freed iteratively, in steps
+        deferfree(10);
+        {
+            variant v;
+            for (int i = 0; i < 100000; i++)
+                v = new reference(v);
+        }
+        check(deferredcount() == 1);
+        check(freedeferred(10) == 10);
+        check(deferredcount() == 1);
+        freedeferredstep();
+        check(deferredcount() == 1);
+        deferfree(0);
+        check(deferredcount() == 0);
+    }
+    {
+        // a cycle of references is reclaimed by the collector
+        trackcycles(true);
+        objptr<reference> r1 = new reference();
+        objptr<reference> r2 = new reference(variant(r1.get()));
+        r1->var = r2.get();
+        check(collectcycles() == 0);
+        r1.clear();
+        r2.clear();
+        check(collectcycles() == 2);
+        trackcycles(false);
+    }
+    {
+        // heap profiler: counted and sampled allocations
+        heapprofile(true, 1);
+        {
+            str s = "abc";
+            s += "def";
+            objptr<object> o = new testobj();
+        }
+        heapprofile(false);
+        FILE* f = tmpfile();
+        heapdump(f);
+        check(ftell(f) > 0);
+        fclose(f);
+    }
     {
         objptr<object> p3 = new testobj();
         objptr<object> p4 = p3;
@@ -90,6 +259,63 @@ static void test_ordset()
 }
 
 
+static void test_charset()
+{
+    charset c1 = "a-z";
+    charset c2 = "A-Za-z";
+    check(!c1.empty());
+    check(c1 <= c2);
+    check(!(c2 <= c1));
+    charset c3 = c2 - c1;
+    check(c3 == charset("A-Z"));
+    check((c3 * c1).empty());
+    check((c3 + c1) == c2);
+    charset c4 = ~c2;
+    check(c4[0] && c4[255] && !c4['a'] && !c4['Z']);
+    c4.invert();
+    check(c4 == c2);
+
+    // scan(): short, long and high-bit inputs
+    const char* s = "abcXYZ";
+    check(c1.scan(s, s + 6) == s + 3);
+    check(c1.scan(s, s) == s);
+    str t(100, 'x');
+    t.replace(77, 'A');
+    check(c1.scan(t.data(), t.end()) == t.data(77));
+    check(c2.scan(t.data(), t.end()) == t.end());
+    charset c5 = c2;
+    c5.include(0x80, 0xff);
+    str u(50, char(0xe9));
+    u.replace(40, char(0x7f));
+    check(c5.scan(u.data(), u.end()) == u.data(40));
+    check(c2.scan(u.data(), u.end()) == u.data());
+
+    // sets changed in place, more of them than scan() keeps tables for
+    for (int i = 0; i < 8; i++)
+    {
+        charset c6 = c1;
+        str w(100, 'x');
+        w.replace(60, char('A' + i));
+        w.replace(90, char('A' + i + 1));
+        check(c6.scan(w.data(), w.end()) == w.data(60));
+        c6.include('A' + i);
+        check(c6.scan(w.data(), w.end()) == w.data(90));
+    }
+
+    // scaneol(): agrees with the equivalent charset
+    str l(100, 'x');
+    check(scaneol(l.data(), l.end()) == l.end());
+    for (int i = 0; i < 100; i += 7)
+    {
+        str v = l;
+        v.replace(i, i % 2 ? '\r' : '\n');
+        v.replace(99, '\n');
+        check(scaneol(v.data(), v.end()) == v.data(i));
+        check(non_eol_chars.scan(v.data(), v.end()) == v.data(i));
+    }
+}
+
+
 void test_bytevec()
 {
     // TODO: check the number of reallocations
@@ -279,6 +505,26 @@ void test_string()
     s8.clear();
     s8.insert(0, "DEF");
     check(s8 == "DEF");
+
+    // interning
+    str s9 = "Interned";
+    str s10 = str("Inter") + "ned";
+    check(s9.obj != s10.obj);
+    s9.intern();
+    s10.intern();
+    check(s9.isinterned());
+    check(s9.obj == s10.obj);
+    check(s9 == s10);
+    str s11 = "Other";
+    s11.intern();
+    check(s9 != s11);
+    s10 += "!";
+    check(!s10.isinterned());
+    check(s10 == "Interned!");
+    check(s9 == "Interned");
+    str s12;
+    s12.intern();
+    check(!s12.isinterned());
 }
 
 
@@ -397,6 +643,24 @@ static void test_vector()
     v1.replace(2, "MNO");
     check(v1[2] == "MNO");
     check(v3[2] == "JKL");
+
+    // variant vectors: copy on write, objects shared with the copy
+    str s2 = "XYZ";
+    varvec v4;
+    for (int i = 0; i < 10; i++)
+        v4.push_back(i);
+    v4.push_back(s2);
+    v4.push_back(variant::null);
+    varvec v5 = v4;
+    v5.replace(0, 100);  // forces a copy
+    check(v4[0].as_ord() == 0);
+    check(v5[0].as_ord() == 100);
+    check(v5[9].as_ord() == 9);
+    check(v5[10].as_str() == "XYZ");
+    check(v5[11].is_null());
+    v4.clear();
+    v5.clear();
+    check(s2 == "XYZ");
 }
 
 
@@ -525,6 +789,63 @@ void test_variant()
         check(v2.as_range().right() == 20);
         check(v1.compare(v2) == -1);
     }
+    {
+        // hashing
+        variant v1 = "Hashable string";
+        variant v2 = str("Hashable ") + "string";
+        check(v1.hash() == v2.hash());
+        check(v1.hash() != variant("Hashable strinG").hash());
+        check(v1.as_str().hash() == v1.hash());
+        v2.as_str().replace(0, 'h');
+        check(v1.hash() != v2.hash());
+        v2.as_str().replace(0, 'H');
+        check(v1.hash() == v2.hash());
+        check(variant(10).hash() == variant(10).hash());
+        check(variant(10).hash() != variant(11).hash());
+        check(variant(range(0, 10)).hash() == variant(range(0, 10)).hash());
+        variant v3 = varvec();
+        v3.as_vec().push_back(1);
+        v3.as_vec().push_back("a");
+        hashint h3 = v3.hash();
+        variant v4 = v3;
+        v4.as_vec().push_back(2);
+        check(v3.hash() == h3);
+        check(v4.hash() != h3);
+        v4.as_vec().pop_back();
+        check(v4.hash() == h3);
+    }
+    {
+        // deep comparison
+        varvec a, b;
+        a.push_back(1); a.push_back("x");
+        b.push_back(1); b.push_back("x");
+        variant v1 = a, v2 = b;
+        check(v1 == v2);
+        check(v1.compare(v2) == 0);
+        b.push_back(0);
+        variant v3 = b;
+        check(v1 != v3);
+        check(v1.compare(v3) < 0 && v3.compare(v1) > 0);
+        a.replace(1, "y");
+        variant v4 = a;
+        check(v4.compare(v3) > 0);
+        varset s1;
+        s1.find_insert(v1);
+        s1.find_insert(v2);  // equal to v1
+        s1.find_insert(v3);
+        check(s1.size() == 2);
+        vardict d1, d2;
+        d1.find_replace(v1, 1);
+        d2.find_replace(v2, 1);
+        check(variant(d1) == variant(d2));
+        d2.find_replace(v3, 2);
+        check(variant(d1) != variant(d2));
+        check(variant(d1).compare(variant(d2)) < 0);
+        ordset o1, o2;
+        o1.find_insert(5);
+        o2.find_insert(6);
+        check(variant(o1).compare(variant(o2)) == -variant(o2).compare(variant(o1)));
+    }
 }
 
 
@@ -545,6 +866,7 @@ static void test_bidir_char_fifo(fifo& fc)
     check(fc.deq(16) == "23456789abcdefgh");
     check(fc.deq(memfifo::CHAR_ALL) == "ijklmnopqrstuvwxyz./");
     check(fc.empty());
+    check_throw(fc.deq(16));
 
     fc.enq("0123456789");
     fc.enq("abcdefghijklmnopqrstuvwxyz");
@@ -553,16 +875,26 @@ static void test_bidir_char_fifo(fifo& fc)
         fc.deq(fifo::CHAR_SOME);
 
     fc.enq("0123456789abcdefghijklmnopqrstuvwxyz");
+    check_throw(fc.deq(-1));
     check(fc.deq("0-9") == "0123456789");
     check(fc.deq("a-z") == "abcdefghijklmnopqrstuvwxyz");
     check(fc.empty());
 }
 
 
+struct drainevent: public fullevent
+{
+    str out;
+    void event(memfifo* f)
+        { out += f->deq(fifo::CHAR_ALL); }
+};
+
+
 static void test_fifos()
 {
 #ifdef DEBUG
     memfifo::CHUNK_SIZE = 2 * sizeof(variant);
+    memfifo::CHAR_CHUNK_SIZE = 16;
 #endif
 
     memfifo f(NULL, false);
@@ -584,11 +916,283 @@ static void test_fifos()
     f.var_preview(vr);
     check(vr.is(variant::SET));
 
+    {
+        // bulk transfer across chunks
+        memfifo fb(NULL, false);
+        str s = "xyz";
+        varvec v;
+        for (int i = 0; i < 7; i++)
+            v.push_back(i);
+        v.push_back(s);
+        fb.enq(v);
+        v.clear();
+        varvec r;
+        check(fb.deq_vars(r, 3) == 3);
+        check(r.size() == 3 && r[2].as_ord() == 2);
+        check(fb.deq_vars(r, 100) == 5);
+        check(r.size() == 8 && r[6].as_ord() == 6 && r[7].as_str() == "xyz");
+        check(fb.empty());
+        check_throw(fb.deq_vars(r, 100));
+        v.push_back(s);
+        fb.enq(v);
+        v.clear();
+        check_throw(fb.deq_vars(r, -1));
+        check(fb.deq_vars(r, 0) == 0);
+        check(fb.deq_vars(r, 1) == 1);
+        r.clear();
+    }
+
+    {
+        // growing chunks keep the order; a drained chunk is kept as a spare
+        memfifo fg(NULL, false);
+        for (int i = 0; i < 100; i++)
+            fg.var_enq(i);
+        variant x;
+        int i = 0;
+        for (; !fg.empty(); i++)
+        {
+            fg.var_deq(x);
+            check(x.as_ord() == i);
+        }
+        check(i == 100);
+#ifdef DEBUG
+        memfifo fr(NULL, false);
+        int a = object::allocated;
+        fr.var_enq(1);
+        fr.var_deq(x);
+        check(object::allocated == a + 1);
+        fr.var_enq(2);
+        check(object::allocated == a + 1);
+        fr.clear();
+        check(object::allocated == a);
+
+        // spares not reused until the fifo is drained again are freed
+        memfifo fs(NULL, true);
+        str s(64, 'x');
+        a = object::allocated;
+        fs.enq(s.data(), 64);
+        check(fs.deq(64) == s);
+        check(object::allocated == a + 4);
+        fs.enq(s.data(), 16);
+        check(object::allocated == a + 4);
+        check(fs.deq(16) == s.substr(0, 16));
+        check(object::allocated == a + 1);
+        fs.clear();
+        check(object::allocated == a);
+#endif
+    }
+
     memfifo fc(NULL, true);
     test_bidir_char_fifo(fc);
 
+    {
+        // bounded fifos: full error without a handler, the handler drains
+        memfifo fv(NULL, false, 2);
+        fv.var_enq(1);
+        fv.var_enq(2);
+        check(fv.size() == 2);
+        check_throw(fv.var_enq(3));
+        variant x;
+        fv.var_deq(x);
+        fv.var_enq(3);
+        check(fv.size() == 2);
+        fv.clear();
+        check(fv.size() == 0);
+
+        memfifo fb(NULL, true, 5);
+        check_throw(fb.enq("abcdefgh"));
+        fb.clear();
+        drainevent d;
+        fb.set_fullevent(&d);
+        fb.enq("abcdefghijklmnopqrstuvwxyz");
+        check(fb.size() <= 5);
+        d.out += fb.deq(fifo::CHAR_ALL);
+        check(d.out == "abcdefghijklmnopqrstuvwxyz");
+        fb.set_fullevent(NULL);
+    }
+
     strfifo fs(NULL);
     test_bidir_char_fifo(fs);
+
+    {
+        // reading a whole string shares it, a partial read copies
+        str s = "abc def";
+        strfifo f1(NULL, s);
+        str t = f1.deq(fifo::CHAR_ALL);
+        check(t == s && t.data() == s.data());
+        strfifo f2(NULL, s);
+        t = f2.token("a-z");
+        check(t == "abc" && t.data() != s.data());
+        t = f2.deq(fifo::CHAR_ALL);
+        check(t == " def");
+    }
+
+    {
+        // varfifo reads a vector in place, leaves the original intact
+        str s = "abc";
+        varvec v;
+        v.push_back(1);
+        v.push_back(s);
+        v.push_back(3);
+        varfifo f1(NULL, v);
+        check(f1.all().begin() == v.begin());
+        variant x;
+        f1.var_deq(x);
+        check(x.as_ord() == 1);
+        f1.var_deq(x);
+        check(x.as_str() == "abc");
+        check(v.size() == 3 && v[1].as_str() == "abc");
+        check(f1.all().size() == 1);
+        f1.var_enq(4);
+        varvec r;
+        check(f1.deq_vars(r, 10) == 2);
+        check(r.size() == 2 && r[1].as_ord() == 4);
+        check(f1.empty());
+
+        // appending builds a vector that all() returns as is
+        varfifo f2(NULL);
+        for (int i = 0; i < 50; i++)
+            f2.var_enq(i);
+        f2.var_enq(s);
+        varvec w = f2.all();
+        check(w.size() == 51 && w[50].as_str() == "abc" && w[49].as_ord() == 49);
+        check(f2.all().begin() == w.begin());
+        f2.var_deq(x);
+        check(x.as_ord() == 0 && w[0].as_ord() == 0);
+        f2.var_enq(5);
+        check(f2.all().size() == 51 && w.size() == 51);
+
+        // a unique vector is consumed in place
+        objptr<reference> ro = new reference();
+        varvec u;
+        u.push_back(variant(ro.get()));
+        u.push_back(s);
+        varfifo f3(NULL, u);
+        u.clear();
+        f3.var_eat();
+        check(ro->isunique());
+        f3.var_deq(x);
+        check(x.as_str() == "abc");
+        check(f3.empty());
+    }
+
+    {
+        // binary fifos: a round trip through a char fifo with small chunks
+        objptr<memfifo> fc = new memfifo(NULL, true);
+        varvec nested;
+        nested.push_back(1);
+        nested.push_back("x");
+        varset st;
+        st.find_insert(variant(2));
+        st.find_insert(variant("z"));
+        ordset os;
+        os.find_insert(0);
+        os.find_insert(100, 130);
+        os.find_insert(255);
+        vardict d;
+        d.find_replace("a", 1);
+        d.find_replace(2, nested);
+        varvec v;
+        v.push_back(variant::null);
+        v.push_back(0);
+        v.push_back(-1);
+        v.push_back(INTEGER_MAX);
+        v.push_back(INTEGER_MIN);
+        v.push_back("abc");
+        v.push_back(str());
+        v.push_back(str(1000, 'x'));
+        v.push_back(variant(5, 9));
+        v.push_back(variant(1, 0));
+        v.push_back(nested);
+        v.push_back(varvec());
+        v.push_back(st);
+        v.push_back(os);
+        v.push_back(d);
+        {
+            objptr<outbin> o = new outbin(NULL, fc);
+            for (int i = 0; i < v.size(); i++)
+                o->var_enq(v[i]);
+            o->var_enq(v);
+        }
+        {
+            // a bad value is dropped as a whole, the rest is still written
+            objptr<memfifo> fm = new memfifo(NULL, true);
+            objptr<outbin> o = new outbin(NULL, fm);
+            varvec r;
+            r.push_back(1);
+            r.push_back(variant(&v.atw(0)));
+            o->var_enq("a");
+            o->var_enq(r);
+            o->var_enq("b");
+            check_throw(o->flush());
+            o->flush();
+            // nesting up to the limit
+            varvec n;
+            for (int i = 0; i < binfmt::MAX_DEPTH; i++)
+            {
+                varvec m;
+                m.push_back(n);
+                n = m;
+            }
+            o->var_enq(n);
+            o->flush();
+            varvec m;
+            m.push_back(n);
+            o->var_enq(m);
+            check_throw(o->flush());
+            o = NULL;
+            objptr<inbin> i = new inbin(NULL, fm);
+            variant x;
+            i->var_deq(x);
+            check(x == "a");
+            i->var_deq(x);
+            check(x == "b");
+            i->var_deq(x);
+            check(x == n);
+            check(i->empty());
+        }
+        objptr<inbin> in = new inbin(NULL, fc);
+        variant x;
+        for (int i = 0; i < v.size(); i++)
+        {
+            in->var_deq(x);
+            check(x == v[i]);
+            check(x.getType() == v[i].getType());
+        }
+        in->var_deq(x);
+        check(x == v);
+        check(in->empty());
+
+        // truncated data
+        fc->enq(char(binfmt::STR));
+        fc->enq(char(5));
+        fc->enq("ab");
+        check_throw(in->var_deq(x));
+
+        // no header, or a set out of order
+        objptr<memfifo> fb = new memfifo(NULL, true);
+        fb->enq(char(binfmt::ORD));
+        fb->enq(char(2));
+        in = new inbin(NULL, fb);
+        check_throw(in->var_deq(x));
+        fb = new memfifo(NULL, true);
+        fb->enq(binfmt::MAGIC, binfmt::MAGIC_SIZE);
+        fb->enq(char(binfmt::VERSION));
+        const char bad[] = {binfmt::SET, 2, binfmt::ORD, 4, binfmt::ORD, 2};
+        fb->enq(bad, sizeof(bad));
+        in = new inbin(NULL, fb);
+        check_throw(in->var_deq(x));
+
+        // nested too deep
+        fb = new memfifo(NULL, true);
+        fb->enq(binfmt::MAGIC, binfmt::MAGIC_SIZE);
+        fb->enq(char(binfmt::VERSION));
+        const char deep[] = {binfmt::VEC, 1};
+        for (int i = 0; i < 100000; i++)
+            fb->enq(deep, sizeof(deep));
+        in = new inbin(NULL, fb);
+        check_throw(in->var_deq(x));
+    }
 }
 
 
@@ -634,6 +1238,149 @@ static void test_parser()
         f.set_bufevent(NULL);
         check(rec.data == "careful with terms like readable"); // Yep!
     }
+#ifdef DEBUG
+    {
+        // same through a memory-mapped file
+#ifdef XCODE
+        const char* filePath = "../../src/tests/stmtest.txt";
+#else
+        const char* filePath = "tests/stmtest.txt";
+#endif
+        int saveMin = intext::MMAP_MIN;
+        intext::MMAP_MIN = 1;
+        intext f(NULL, filePath);
+        f.deq(11);
+        check(f.tellg() == 11);
+        InputRecorder rec;
+        f.set_bufevent(&rec);
+        f.deq(32);
+        f.set_bufevent(NULL);
+        check(rec.data == "careful with terms like readable");
+        check(f.tellg() == 43);
+        str rest = f.deq(fifo::CHAR_ALL);
+        check(rest.size() == 615 - 43);
+        check(f.eof());
+        check(f.tellg() == 615);
+        intext::MMAP_MIN = saveMin;
+    }
+    {
+        // a small file read in one piece
+#ifdef XCODE
+        const char* filePath = "../../src/tests/stmtest.txt";
+#else
+        const char* filePath = "tests/stmtest.txt";
+#endif
+        int saveSize = intext::BUF_SIZE;
+        intext::BUF_SIZE = 4096;
+        str all;
+        {
+            intext f(NULL, filePath);
+            all = f.deq(fifo::CHAR_ALL);
+            check(f.eof());
+            check(f.tellg() == 615);
+        }
+        check(all.size() == 615);
+        check(all.substr(11, 32) == "careful with terms like readable");
+        intext::BUF_SIZE = saveSize;
+    }
+#endif
+    {
+        // data appended to a small file after it was read is still seen
+        const char* filePath = "apptest.tmp";
+        {
+            outtext f(NULL, filePath);
+            f << "abc";
+        }
+        intext f(NULL, filePath);
+        check(f.deq(3) == "abc");
+        int fd = ::open(filePath, O_WRONLY | O_APPEND);
+        check(fd >= 0);
+        check(::write(fd, "def", 3) == 3);
+        ::close(fd);
+        check(f.deq(fifo::CHAR_ALL) == "def");
+        check(f.eof());
+        ::remove(filePath);
+    }
+    {
+        // big strings are written in place, in the right order
+        const char* filePath = "outtest.tmp";
+        str big(outgather::HOLD_MIN, 'a');
+        str raw(outgather::HOLD_MIN + 1, 'b');
+        str expect;
+        {
+            outtext f(NULL, filePath);
+            f << "head";
+            f << big;
+            f << "mid";
+            f.enq(raw.data(), raw.size());
+            expect = "head" + big + "mid" + raw;
+            for (int i = 0; i < outgather::MAX_HELD + 2; i++)
+            {
+                f << to_string(i) << big;
+                expect += to_string(i) + big;
+            }
+            f << "tail";
+            expect += "tail";
+        }
+        {
+            intext f(NULL, filePath);
+            check(f.deq(fifo::CHAR_ALL) == expect);
+        }
+        // the same through sio, with stdout redirected to the file
+        int fd = ::open(filePath, O_WRONLY | O_TRUNC);
+        check(fd >= 0);
+        sio.flush();
+        int saveout = ::dup(STDOUT_FILENO);
+        check(saveout >= 0 && ::dup2(fd, STDOUT_FILENO) >= 0);
+        ::close(fd);
+        sio.setflush(stdfile::FLUSH_FULL);
+        sio << "head";
+        sio << big;
+        sio << "mid";
+        sio.enq(raw.data(), raw.size());
+        sio << "tail";
+        sio.flush();
+        ::dup2(saveout, STDOUT_FILENO);
+        ::close(saveout);
+        sio.setflush(stdfile::FLUSH_AUTO);
+        {
+            intext f(NULL, filePath);
+            check(f.deq(fifo::CHAR_ALL) == "head" + big + "mid" + raw + "tail");
+        }
+        ::remove(filePath);
+    }
+}
+
+
+void test_vm()
+{
+    {
+        // deferred destruction doesn't hold locals past their function's exit
+        const char* filePath = "defertest.shn";
+        {
+            outtext f(NULL, filePath);
+            f << "def nfp = int *(int)...\n"
+                "def int napply(nfp f[], int v) { var g = f[0]; return g(v) }\n"
+                "def int nouter(int a)\n"
+                "{\n"
+                "    var loc = 10\n"
+                "    def int inner(int i) { return i + loc }\n"
+                "    return napply([inner], a)\n"
+                "}\n"
+                "var r = 0\n"
+                "for i = 0..99: r += nouter(i)\n"
+                "assert r == 5950\n";
+        }
+        {
+            Context context;
+            context.options.enableDump = false;
+            context.options.vmListing = false;
+            context.options.deferFreeStep = 1;
+            context.loadModule(filePath);
+            check(context.execute().is_null());
+        }
+        ::remove(filePath);
+    }
 }
 
 
@@ -692,12 +1439,16 @@ int main()
         << "  real: " << sizeof(real) << "  variant: " << sizeof(variant)
         << "  object: " << sizeof(object) << "  rtobject: " << sizeof(rtobject) << '\n';
     sio << "stateobj: " << sizeof(stateobj) << "  Type: " << sizeof(Type)
-        << "  State: " << sizeof(State) << "  opcodes: " << opMaxCode << '\n';
+        << "  State: " << sizeof(State) << "  container: " << sizeof(container)
+        << "  opcodes: " << opMaxCode << '\n';
 
     check(sizeof(memint) == sizeof(void*));
     check(sizeof(memint) == sizeof(size_t));
 
-#ifdef SHN_64
+#if defined(SHN_64) && defined(SHN_PACKVAR)
+    check(sizeof(integer) == 8);
+    check(sizeof(variant) == 12);
+#elif defined(SHN_64)
     check(sizeof(integer) == 8);
     check(sizeof(variant) <= 16);
 #else
@@ -713,8 +1464,13 @@ int main()
     try
     {
         test_common();
+#ifdef SHN_THR
+        test_thr_alloc();
+        test_thr_share();
+#endif
         test_object();
         test_ordset();
+        test_charset();
         test_bytevec();
         test_string();
         test_strutils();
@@ -726,6 +1482,7 @@ int main()
         test_variant();
         test_fifos();
         test_parser();
+        test_vm();
 //        test_typesys();
 //        test_codegen();
     }
@@ -1,4 +1,6 @@
 
+#include <signal.h>
+
 #include "common.h"
 #include "runtime.h"
 #include "parser.h"
@@ -29,8 +31,24 @@ int main()
     initTypeSys();
     initVm();
 
+    // SHN_HEAPPROF=<period>: profile allocations, sample every Nth one (if
+    // non-zero) and dump on exit and on SIGUSR1 to SHN_HEAPPROF_OUT or stderr
+    const char* heapProf = getenv("SHN_HEAPPROF");
+    const char* heapProfOut = getenv("SHN_HEAPPROF_OUT");
+    if (heapProf != NULL)
+    {
+        heapprofile(true, atol(heapProf));
+        heapdumponsignal(SIGUSR1, heapProfOut);
+    }
+
+    // SHN_DEFERFREE=<step>: queue released objects and destroy at most <step>
+    // of them at a time at loop back-edges and function exits, see deferfree()
+    const char* deferFree = getenv("SHN_DEFERFREE");
+
     {
         Context context;
+        if (deferFree != NULL)
+            context.options.deferFreeStep = atol(deferFree);
         
         try
         {
@@ -67,12 +85,26 @@ int main()
                 exitcode = 104;
             }
         }
+
+        // While the states are still alive
+        if (heapProf != NULL)
+        {
+            heapprofile(false);
+            if (heapProfOut == NULL || !heapdump(heapProfOut))
+                heapdump(stderr);
+        }
     }
 
     doneVm();
     doneTypeSys();
     doneRuntime();
 
+    if (getenv("SHN_MEMSTATS") != NULL)
+    {
+        pmemstats(stderr);
+        cyclestats(stderr);
+    }
+
 #ifdef DEBUG
     // TODO: make this a compiler option
     if (object::allocated != 0)
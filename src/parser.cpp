@@ -298,8 +298,8 @@ restart:
         Token tok = keywords.find(strValue.c_str());
         if (tok != tokUndefined)
             return token = tok;
-        else
-            return token = tokIdent;
+        strValue.intern();
+        return token = tokIdent;
     }
 
     // --- Number ---
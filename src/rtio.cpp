@@ -1,10 +1,15 @@
 
+#include <sys/mman.h>
+#include <sys/uio.h>
+
 #include "runtime.h"
 
 
 #ifdef DEBUG
 int memfifo::CHUNK_SIZE = 32 * _varsize;
+int memfifo::CHAR_CHUNK_SIZE = 4096;
 int intext::BUF_SIZE = 4096 * int(sizeof(integer));
+int intext::MMAP_MIN = 256 * 1024;
 #endif
 
 
@@ -24,9 +29,11 @@ void fifo::_wronly_err()                { throw efifo("FIFO is write-only"); }
 void fifo::_rdonly_err()                { throw efifo("FIFO is read-only"); }
 void fifo::_fifo_type_err()             { fatal(0x2001, "FIFO type mismatch"); }
 void fifo::_token_err()                 { throw efifo("Token too long"); }
+void fifo::_count_err()                 { throw efifo("Negative element count"); }
 const char* fifo::get_tail()            { _wronly_err(); return NULL; }
 const char* fifo::get_tail(memint*)     { _wronly_err(); return NULL; }
 void fifo::deq_bytes(memint)            { _wronly_err(); }
+const str* fifo::get_tail_str(memint)   { return NULL; }
 variant* fifo::enq_var()                { _rdonly_err(); return NULL; }
 void fifo::enq_char(char)               { _rdonly_err(); }
 memint fifo::enq_chars(const char*, memint) { _rdonly_err(); return 0; }
@@ -121,9 +128,9 @@ void fifo::var_eat()
         get();
     else
     {
-        _req_non_empty();
-        ((variant*)get_tail())->~variant();
-        deq_bytes(_varsize);
+        // Dequeue into a temporary as the fifo may not own the variant
+        variant v;
+        deq_var(&v);
     }
 }
 
@@ -170,6 +177,8 @@ void fifo::var_enq(const variant& v)
 
 str fifo::deq(memint count)
 {
+    if (count < 0)
+        _count_err();
     _req_non_empty(true);
     str result;
     while (count > 0)
@@ -180,7 +189,7 @@ str fifo::deq(memint count)
             break;
         if (count < avail)
             avail = count;
-        result.append(p, avail);
+        _deq_tail(p, avail, &result);
         deq_bytes(avail);
         if (count == CHAR_SOME)
             break;
@@ -190,72 +199,179 @@ str fifo::deq(memint count)
 }
 
 
+void fifo::_deq_tail(const char* p, memint count, str* result)
+{
+    // If the data is the whole of a string object, e.g. a strfifo's string
+    // or a small file read in one piece, the string is shared rather than
+    // copied; it is then copied only if the result is modified
+    const str* s;
+    if (result->empty() && (s = get_tail_str(count)) != NULL)
+        *result = *s;
+    else
+        result->append(p, count);
+}
+
+
+bool fifo::_token_part(const char* p, memint count, memint avail, memint* total, str* result)
+{
+    // Takes the first 'count' of 'avail' bytes at the tail; returns true if
+    // the token may continue in the next buffer
+    if (count == 0)
+        return false;
+    if (max_token > 0)
+    {
+        *total += count;
+        if (*total > max_token)
+            _token_err();
+    }
+    if (result != NULL)
+        _deq_tail(p, count, result);
+    deq_bytes(count);
+    return count == avail;
+}
+
+
 void fifo::_token(const charset& chars, str* result)
 {
     _req(true);
     memint total = 0;
-    while (1)
-    {
-        memint avail;
-        const char* b = get_tail(&avail);
-        if (b == NULL)
+    memint avail;
+    const char* b;
+    while ((b = get_tail(&avail)) != NULL)
+        if (!_token_part(b, chars.scan(b, b + avail) - b, avail, &total, result))
             break;
-        const char* p = b;
-        const char* e = b + avail;
-        while (p < e && chars[*p])
-            p++;
-        memint count = p - b;
-        if (count == 0)
-            break;
-        if (max_token > 0)
-        {
-            total += count;
-            if (total > max_token)
-                _token_err();
-        }
-        if (result != NULL)
-            result->append(b, count);
-        deq_bytes(count);
-        if (count < avail)
+}
+
+
+void fifo::_line(str* result)
+{
+    // Same as _token(non_eol_chars, result) with the specialized kernel
+    _req(true);
+    memint total = 0;
+    memint avail;
+    const char* b;
+    while ((b = get_tail(&avail)) != NULL)
+        if (!_token_part(b, scaneol(b, b + avail) - b, avail, &total, result))
             break;
-    }
 }
 
 
 str fifo::line()
 {
     str result;
-    _token(non_eol_chars, &result);
+    _line(&result);
     skip_eol();
     return result;
 }
 
 
+void fifo::skip_line()
+{
+    _line(NULL);
+    skip_eol();
+}
+
+
 void fifo::enq(const char* s)   { if (s != NULL) enq(s, strlen(s)); }
-void fifo::enq(const str& s)    { enq_chars(s.data(), s.size()); }
+void fifo::enq(const str& s)    { enq_str(s); }
+void fifo::enq_str(const str& s) { enq_chars(s.data(), s.size()); }
 void fifo::enq(large i)         { enq(to_string(i)); }
 
 
+void fifo::enq_vars(const variant* p, memint count)
+{
+    for ( ; count > 0; count--, p++)
+        new(enq_var()) variant(*p);
+}
+
+
 void fifo::enq(const varvec& v)
 {
     _req(false);
-    for (memint i = 0; i < v.size() - 1; i++)
-        new(enq_var()) variant(v[i]);
+    if (!v.empty())
+        enq_vars(&v[0], v.size());
+}
+
+
+memint fifo::deq_vars(varvec& v, memint max)
+{
+    // Variants are moved as POD data, the refcounts remain intact
+    if (max < 0)
+        _count_err();
+    _req_non_empty(false);
+    memint total = 0;
+    while (total < max)
+    {
+        memint avail;
+        const char* p = get_tail(&avail);
+        if (p == NULL)
+            break;
+        memint count = avail / _varsize;
+        assert(count > 0);
+        if (count > max - total)
+            count = max - total;
+        memint pos = v.size();
+        v.grow(count);
+        void* d = &v.atw(pos);
+        ::memcpy(d, p, count * _varsize);
+        deq_bytes(count * _varsize);
+        total += count;
+    }
+    return total;
 }
 
 
 // --- memfifo ------------------------------------------------------------- //
 
 
-memfifo::memfifo(Type* rt, bool ch) throw()
-    : fifo(rt, ch), head(NULL), tail(NULL), head_offs(0), tail_offs(0)  { }
+memfifo::memfifo(Type* rt, bool ch, memint capacity) throw()
+    : fifo(rt, ch), head(NULL), tail(NULL), spare(NULL), head_offs(0), tail_offs(0),
+      chunksize(ch ? CHAR_CHUNK_SIZE : CHUNK_SIZE), sparesize(0), sparelow(0),
+      queued(0), limit(0), onfull(NULL)  { set_capacity(capacity); }
 
 
 memfifo::~memfifo() throw()             { try { clear(); } catch(exception&) { } }
+
 inline const char* memfifo::get_tail()  { return tail ? (tail->data + tail_offs) : NULL; }
 inline bool memfifo::empty() const      { return tail == NULL; }
-inline variant* memfifo::enq_var()      { _req(false); return (variant*)enq_space(_varsize); }
 str memfifo::get_name() const           { return "<memfifo>"; }
+void memfifo::set_capacity(memint c)    { limit = c * (is_char_fifo() ? 1 : _varsize); }
+
+
+void memfifo::set_chunk_size(int s)
+{
+    if (s <= 0 || (!is_char_fifo() && s % _varsize != 0))
+        fatal(0x2002, "Invalid FIFO chunk size");
+    chunksize = s;
+}
+
+
+inline variant* memfifo::enq_var()
+{
+    _req(false);
+    if (limit > 0 && queued >= limit)
+        wait_room();
+    return (variant*)enq_space(_varsize);
+}
+
+
+fullevent* memfifo::set_fullevent(fullevent* e)
+{
+    fullevent* prev = onfull;
+    onfull = e;
+    return prev;
+}
+
+
+void memfifo::wait_room()
+{
+    // Give the handler a chance to drain the fifo; a handler that returns
+    // without making room would otherwise spin forever
+    if (onfull != NULL)
+        onfull->event(this);
+    if (queued >= limit)
+        _full_err();
+}
 
 
 void memfifo::clear()
@@ -266,7 +382,7 @@ void memfifo::clear()
         while (tail != NULL)
         {
 #ifdef DEBUG
-            head_offs = tail_offs = CHUNK_SIZE;
+            head_offs = tail_offs = tail->size;
 #endif
             deq_chunk();
         }
@@ -279,6 +395,36 @@ void memfifo::clear()
             deq_bytes(_varsize);
         }
     }
+    queued = 0;
+    free_spare();
+}
+
+
+void memfifo::free_spare()
+{
+    while (spare != NULL)
+    {
+        chunk* c = spare;
+        spare = c->next;
+        delete c;
+    }
+    sparesize = sparelow = 0;
+}
+
+
+void memfifo::trim_spare()
+{
+    // Called when the fifo becomes empty: the spares that weren't taken
+    // since the last time aren't needed for this fifo's traffic
+    for (memint excess = sparelow; excess > 0 && spare != NULL; )
+    {
+        chunk* c = spare;
+        spare = c->next;
+        excess -= c->size;
+        sparesize -= c->size;
+        delete c;
+    }
+    sparelow = sparesize;
 }
 
 
@@ -286,25 +432,48 @@ void memfifo::deq_chunk()
 {
     assert(tail != NULL && head != NULL);
     chunk* c = tail;
+    assert(tail == head ? head_offs == tail_offs : tail_offs == c->size);
     tail = tail->next;
-    delete c;
+    if (c->size == chunksize && sparesize + c->size <= MAX_SPARE)
+    {
+        c->next = spare;
+        spare = c;
+        sparesize += c->size;
+    }
+    else
+        delete c;
     if (tail == NULL)
     {
-        assert(head_offs == tail_offs);
         head = NULL;
         head_offs = tail_offs = 0;
+        trim_spare();
     }
     else
-    {
-        assert(tail_offs == CHUNK_SIZE);
         tail_offs = 0;
-    }
 }
 
 
 void memfifo::enq_chunk()
 {
-    chunk* c = new chunk();
+    // A variant fifo that already holds more than one chunk is probably
+    // streaming in bulk, so it gets bigger chunks from now on
+    if (head != tail && !is_char_fifo() && chunksize < MAX_CHUNK_SIZE)
+        chunksize *= 2;
+    chunk* c;
+    if (spare != NULL && spare->size == chunksize)
+    {
+        c = spare;
+        spare = c->next;
+        sparesize -= c->size;
+        if (sparesize < sparelow)
+            sparelow = sparesize;
+        c->next = NULL;
+    }
+    else
+    {
+        free_spare();  // none or outgrown
+        c = new(chunksize) chunk(chunksize);
+    }
     if (head == NULL)
     {
         assert(tail == NULL && head_offs == 0);
@@ -312,7 +481,7 @@ void memfifo::enq_chunk()
     }
     else
     {
-        assert(head_offs == CHUNK_SIZE);
+        assert(head_offs == head->size);
         head->next = c;
         head = c;
         head_offs = 0;
@@ -330,36 +499,45 @@ const char* memfifo::get_tail(memint* count)
     if (tail == head)
         *count = head_offs - tail_offs;
     else
-        *count = CHUNK_SIZE - tail_offs;
-    assert(*count <= CHUNK_SIZE);
+        *count = tail->size - tail_offs;
+    assert(*count <= tail->size);
     return tail->data + tail_offs;
 }
 
 
 void memfifo::deq_bytes(memint count)
 {
-    assert(tail != NULL && (tail_offs + count) <= ((tail == head) ? head_offs : CHUNK_SIZE));
+    assert(tail != NULL && (tail_offs + count) <= ((tail == head) ? head_offs : tail->size));
     tail_offs += int(count);
-    if (tail_offs == ((tail == head) ? head_offs : CHUNK_SIZE))
+    queued -= count;
+    if (tail_offs == ((tail == head) ? head_offs : tail->size))
         deq_chunk();
 }
 
 
 memint memfifo::enq_avail()
 {
-    if (head == NULL || head_offs == CHUNK_SIZE)
-        return CHUNK_SIZE;
-    return CHUNK_SIZE - head_offs;
+    memint avail = (head == NULL || head_offs == head->size) ?
+        chunksize : head->size - head_offs;
+    if (limit > 0)
+    {
+        if (queued >= limit)
+            wait_room();
+        if (avail > limit - queued)
+            avail = limit - queued;
+    }
+    return avail;
 }
 
 
 char* memfifo::enq_space(memint count)
 {
-    if (head == NULL || head_offs == CHUNK_SIZE)
+    if (head == NULL || head_offs == head->size)
         enq_chunk();
-    assert(count <= CHUNK_SIZE - head_offs);
+    assert(count <= head->size - head_offs);
     char* result = head->data + head_offs;
     head_offs += int(count);
+    queued += count;
     return result;
 }
 
@@ -367,10 +545,32 @@ char* memfifo::enq_space(memint count)
 void memfifo::enq_char(char c)
 {
     _req(true);
+    if (limit > 0 && queued >= limit)
+        wait_room();
     *enq_space(1) = c;
 }
 
 
+void memfifo::enq_vars(const variant* p, memint count)
+{
+    // Copy chunk spans as POD data, then grab the objects
+    _req(false);
+    while (count > 0)
+    {
+        memint avail = enq_avail() / _varsize;
+        if (count < avail)
+            avail = count;
+        char* d = enq_space(avail * _varsize);
+        ::memcpy(d, p, avail * _varsize);
+        for (variant* v = (variant*)d, * e = v + avail; v < e; v++)
+            if (v->is_anyobj() && v->_anyobj() != NULL)
+                v->_anyobj()->grab();
+        count -= avail;
+        p += avail;
+    }
+}
+
+
 memint memfifo::enq_chars(const char* p, memint count)
 {
     _req(true);
@@ -535,6 +735,14 @@ void strfifo::clear()
 }
 
 
+const str* strfifo::get_tail_str(memint count)
+{
+    if (buftail == 0 && !string.empty() && bufhead == string.size() && count == bufhead)
+        return &string;
+    return NULL;
+}
+
+
 bool strfifo::empty() const
 {
     if (buftail == bufhead)
@@ -565,6 +773,105 @@ str strfifo::all() const
 }
 
 
+// --- varfifo ------------------------------------------------------------- //
+
+
+varfifo::varfifo(Type* rt) throw()  : buffifo(rt, false), vector(), copying(false)  {}
+str varfifo::get_name() const       { return "<varfifo>"; }
+
+
+varfifo::varfifo(Type* rt, const varvec& v) throw()
+    : buffifo(rt, false), vector(v), copying(false)
+{
+    buffer = (char*)v.begin();
+    bufhead = bufsize = v.size() * _varsize;
+}
+
+
+varfifo::~varfifo() throw()         { clear(); }
+
+
+void varfifo::clear()
+{
+    // Variants before buftail have been moved out of a unique vector (see
+    // fifo::deq_var()), the vector should not release them again
+    if (buftail > 0 && !copying)
+        memset(buffer, 0, buftail);
+    vector.clear();
+    buffer = NULL;
+    buftail = bufhead = bufsize = 0;
+    copying = false;
+}
+
+
+const char* varfifo::get_tail()
+{
+    // Reading starts: variants are moved out of a unique vector, while a
+    // shared one is left intact and its elements are copied, see deq_bytes()
+    if (buftail == 0)
+        copying = !vector.isunique();
+    return buffifo::get_tail();
+}
+
+
+const char* varfifo::get_tail(memint* count)
+{
+    if (buftail == 0)
+        copying = !vector.isunique();
+    return buffifo::get_tail(count);
+}
+
+
+void varfifo::deq_bytes(memint count)
+{
+    if (copying)
+        for (variant* v = (variant*)(buffer + buftail), * e = v + count / _varsize; v < e; v++)
+            if (v->is_anyobj() && v->_anyobj() != NULL)
+                v->_anyobj()->grab();
+    buffifo::deq_bytes(count);
+}
+
+
+bool varfifo::empty() const
+{
+    if (buftail == bufhead)
+    {
+        call_bufevent();
+        if (!vector.empty())
+            ((varfifo*)this)->clear();
+        return true;
+    }
+    return false;
+}
+
+
+void varfifo::flush()
+{
+    // Extra elements are null variants, enq_var() overwrites them
+    assert(bufhead == bufsize);
+    vector.grow(memfifo::CHUNK_SIZE / _varsize);
+    buffer = (char*)vector.begin();
+    bufsize = vector.size() * _varsize;
+}
+
+
+varvec varfifo::all() const
+{
+    if (buftail == bufhead)
+        return varvec();
+    if (bufhead < bufsize)
+    {
+        // Drop the unused tail left by flush() so that the vector can be
+        // returned as is
+        varfifo* self = (varfifo*)this;
+        self->vector.erase(bufhead / _varsize, (bufsize - bufhead) / _varsize);
+        self->buffer = (char*)vector.begin();
+        self->bufsize = bufhead;
+    }
+    return vector.subvec(buftail / _varsize, (bufhead - buftail) / _varsize);
+}
+
+
 // --- intext -------------------------------------------------------------- //
 
 
@@ -575,9 +882,10 @@ str strfifo::all() const
 
 
 intext::intext(Type* rt, const str& fn) throw()
-    : buffifo(rt, true), file_name(fn), _fd(-1), _eof(false)  { }
+    : buffifo(rt, true), file_name(fn), _fd(-1), _eof(false), _bufshared(false),
+      _map(NULL), _mapsize(0)  { }
 
-intext::~intext() throw()       { if (_fd > 2) ::close(_fd); }
+intext::~intext() throw()       { unmap(); if (_fd > 2) ::close(_fd); }
 void intext::error(int code)    { _eof = true; throw esyserr(code, file_name); }
 str intext::get_name() const    { return file_name; }
 
@@ -591,12 +899,83 @@ void intext::doopen()
 }
 
 
+bool intext::domap(memint* readsize)
+{
+    // Only files read from the beginning; anything that can't be mapped is
+    // read as usual. Small files are read in one piece of their exact size,
+    // so that the buffer can be shared by a string that takes it all.
+    struct stat st;
+    if (::fstat(_fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || ::lseek(_fd, 0, SEEK_CUR) != 0)
+        return false;
+    if (st.st_size < intext::MMAP_MIN || st.st_size > MEMINT_MAX)
+    {
+        if (st.st_size > 0 && st.st_size < *readsize)
+            *readsize = memint(st.st_size);
+        return false;
+    }
+    void* p = ::mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    ::madvise(p, size_t(st.st_size), MADV_SEQUENTIAL);
+    // Further reads, if any, continue after the mapped part
+    if (::lseek(_fd, st.st_size, SEEK_SET) < 0)
+    {
+        ::munmap(p, size_t(st.st_size));
+        return false;
+    }
+    _map = (char*)p;
+    _mapsize = memint(st.st_size);
+    buffer = _map;
+    buftail = 0;
+    bufsize = bufhead = _mapsize;
+    return true;
+}
+
+
+void intext::unmap()
+{
+    if (_map != NULL)
+    {
+        ::munmap(_map, size_t(_mapsize));
+        _map = NULL;
+        _mapsize = 0;
+    }
+}
+
+
+const str* intext::get_tail_str(memint count)
+{
+    if (_map == NULL && buftail == 0 && bufhead > 0 && bufhead == filebuf.size()
+            && count == bufhead)
+    {
+        _bufshared = true;
+        return &filebuf;
+    }
+    return NULL;
+}
+
+
 void intext::doread()
 {
     call_bufevent();
-    filebuf.resize(intext::BUF_SIZE);
+    memint readsize = intext::BUF_SIZE;
+    if (_map != NULL)
+        unmap();
+    else if (buforig == 0 && bufhead == 0 && domap(&readsize))
+    {
+        call_bufevent();
+        return;
+    }
+    // Don't overwrite the buffer if a string refers to it
+    if (_bufshared || filebuf.size() != readsize)
+    {
+        filebuf.clear();
+        _bufshared = false;
+    }
+    filebuf.resize(readsize);
     buffer = (char*)filebuf.data();
-    memint result = ::read(_fd, buffer, intext::BUF_SIZE);
+    memint result = ::read(_fd, buffer, readsize);
     if (result < 0)
         error(errno);
     buforig += bufhead;
@@ -619,6 +998,66 @@ bool intext::empty() const
 }
 
 
+// --- outgather ----------------------------------------------------------- //
+
+
+memint outgather::write(int fd, const char* buf, memint len, const char* extra, memint extralen)
+{
+    iovec iov[MAX_HELD * 2 + 2];
+    int n = 0;
+    memint prev = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (pos[i] > prev)
+        {
+            iov[n].iov_base = (char*)buf + prev;
+            iov[n++].iov_len = pos[i] - prev;
+            prev = pos[i];
+        }
+        iov[n].iov_base = (char*)held[i].data();
+        iov[n++].iov_len = held[i].size();
+    }
+    if (len > prev)
+    {
+        iov[n].iov_base = (char*)buf + prev;
+        iov[n++].iov_len = len - prev;
+    }
+    if (extralen > 0)
+    {
+        iov[n].iov_base = (char*)extra;
+        iov[n++].iov_len = extralen;
+    }
+
+    memint total = 0;
+    int first = 0;
+    while (first < n)
+    {
+        memint ret = ::writev(fd, iov + first, n - first);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            total = -errno;
+            break;
+        }
+        total += ret;
+        // Partial write: skip what's been written and retry
+        while (first < n && umemint(ret) >= iov[first].iov_len)
+            ret -= iov[first++].iov_len;
+        if (first < n)
+        {
+            iov[first].iov_base = (char*)iov[first].iov_base + ret;
+            iov[first].iov_len -= ret;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+        held[i].clear();
+    count = 0;
+    return total;
+}
+
+
 // --- outtext -------------------------------------------------------------- //
 
 
@@ -650,23 +1089,53 @@ str outtext::get_name() const
     { return file_name; }
 
 
+void outtext::write(const char* extra, memint extralen)
+{
+    if (_fd < 0)
+    {
+        _fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+        if (_fd < 0)
+            error(errno);
+    }
+    memint ret = gather.write(_fd, buffer, bufhead, extra, extralen);
+    bufhead = 0;
+    if (ret < 0)
+        error(int(-ret));
+    buforig += ret;
+}
+
+
 void outtext::flush()
 {
     if (_err)
         return;
-    if (bufhead > 0)
+    if (bufhead > 0 || !gather.empty())
+        write(NULL, 0);
+}
+
+
+memint outtext::enq_chars(const char* p, memint count)
+{
+    // Big pieces of data go straight to the file along with the buffer
+    if (count < outgather::HOLD_MIN)
+        return buffifo::enq_chars(p, count);
+    _req(true);
+    if (!_err)
+        write(p, count);
+    return count;
+}
+
+
+void outtext::enq_str(const str& s)
+{
+    if (s.size() < outgather::HOLD_MIN)
+        buffifo::enq_chars(s.data(), s.size());
+    else if (!_err)
     {
-        if (_fd < 0)
-        {
-            _fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
-            if (_fd < 0)
-                error(errno);
-        }
-        memint ret = ::write(_fd, buffer, bufhead);
-        if (ret < 0)
-            error(errno);
-        buforig += bufhead;
-        bufhead = 0;
+        _req(true);
+        if (gather.full())
+            flush();
+        gather.hold(s, bufhead);
     }
 }
 
@@ -674,8 +1143,8 @@ void outtext::flush()
 // --- stdfile ------------------------------------------------------------- //
 
 
-stdfile::stdfile(int infd, int outfd) throw()
-    : intext(NULL, "<stdio>"), _ofd(outfd)
+stdfile::stdfile(int infd, int outfd, FlushMode m) throw()
+    : intext(NULL, "<stdio>"), _ofd(outfd), _oflush(m), _ohead(0)
 {
     _fd = infd;
     if (infd == -1)
@@ -683,19 +1152,566 @@ stdfile::stdfile(int infd, int outfd) throw()
     _mkstatic();
 }
 
+
 stdfile::~stdfile() throw()
-    { }
+{
+    try
+        { flush(); }
+    catch (exception&)
+        { }
+}
+
+
+int stdfile::flushmode()
+{
+    // Not known until the first output: the file may be redirected
+    if (_oflush == FLUSH_AUTO)
+        _oflush = isatty(_ofd) ? FLUSH_LINE : FLUSH_FULL;
+    return _oflush;
+}
+
+
+void stdfile::write(const char* extra, memint extralen)
+{
+    memint ret = _gather.write(_ofd, _obuf, _ohead, extra, extralen);
+    _ohead = 0;
+    if (ret < 0)
+        throw esyserr(int(-ret), file_name);
+}
+
+
+void stdfile::flush()
+{
+    if (_ohead > 0 || !_gather.empty())
+        write(NULL, 0);
+}
+
+
+bool stdfile::empty() const
+{
+    // Prompts should be seen before the input is requested
+    if (buftail == bufhead && (_ohead > 0 || !_gather.empty()))
+        ((stdfile*)this)->flush();
+    return intext::empty();
+}
+
 
 void stdfile::enq_char(char c)
-    { if (::write(_ofd, &c, 1) < 1) _full_err(); }
+{
+    if (_ohead == OBUF_SIZE)
+        flush();
+    _obuf[_ohead++] = c;
+    int m = flushmode();
+    if (m == FLUSH_ALWAYS || (m == FLUSH_LINE && c == '\n'))
+        flush();
+}
+
 
 memint stdfile::enq_chars(const char* p, memint count)
-    { return ::write(_ofd, p, count); }
+{
+    // Big pieces of data go straight to the file along with the buffer
+    if (count >= outgather::HOLD_MIN)
+    {
+        write(p, count);
+        return count;
+    }
+    memint save_count = count;
+    const char* save_p = p;
+    while (count > 0)
+    {
+        if (_ohead == OBUF_SIZE)
+            flush();
+        memint avail = OBUF_SIZE - _ohead;
+        if (count < avail)
+            avail = count;
+        memcpy(_obuf + _ohead, p, avail);
+        _ohead += avail;
+        count -= avail;
+        p += avail;
+    }
+    int m = flushmode();
+    if (m == FLUSH_ALWAYS || (m == FLUSH_LINE && memchr(save_p, '\n', save_count)))
+        flush();
+    return save_count;
+}
 
 
+void stdfile::enq_str(const str& s)
+{
+    if (s.size() < outgather::HOLD_MIN)
+    {
+        enq_chars(s.data(), s.size());
+        return;
+    }
+    if (_gather.full())
+        flush();
+    _gather.hold(s, _ohead);
+    int m = flushmode();
+    if (m == FLUSH_ALWAYS || (m == FLUSH_LINE && memchr(s.data(), '\n', s.size())))
+        flush();
+}
+
 
 stdfile sio(STDIN_FILENO, STDOUT_FILENO);
-stdfile serr(-1, STDERR_FILENO);
+stdfile serr(-1, STDERR_FILENO, stdfile::FLUSH_LINE);
+
+
+// --- inbin, outbin ------------------------------------------------------- //
+
+
+const char binfmt::MAGIC[MAGIC_SIZE] = {'S', 'H', 'N', 'B'};
+
+
+inbin::inbin(Type* rt, fifo* s) throw()
+    : buffifo(rt, false), source(s), rbase(NULL), rp(NULL), re(NULL), started(false)
+{
+    varbuf.resize(BUF_VARS * _varsize);
+    buffer = (char*)varbuf.data();
+    bufsize = BUF_VARS * _varsize;
+}
+
+
+inbin::~inbin() throw()
+{
+    // Variants before buftail have been moved out
+    for (memint i = buftail; i < bufhead; i += _varsize)
+        ((variant*)(buffer + i))->~variant();
+}
+
+
+void inbin::_bin_err()                  { throw efifo("Bad binary data"); }
+str inbin::get_name() const             { return source->get_name(); }
+
+
+bool inbin::empty() const
+{
+    if (buftail == bufhead)
+        return !((inbin*)this)->fill();
+    return false;
+}
+
+
+bool inbin::fill()
+{
+    // Decode as many variants as there are in the source's current buffer,
+    // but at least one, which may cause the source to read more
+    buftail = bufhead = 0;
+    source->_req(true);
+    if (source->empty())
+        return false;
+    if (!started)
+    {
+        getheader();
+        started = true;
+        if (rp == re)
+        {
+            commit();
+            if (source->empty())
+                return false;
+        }
+    }
+    do
+    {
+        // Only complete values are assigned to *v, so that nothing leaks
+        // if the data is bad
+        variant* v = ::new(buffer + bufhead) variant();
+        getvar(*v, 0);
+        bufhead += _varsize;
+    }
+    while (bufhead < bufsize && rp < re);
+    commit();
+    return true;
+}
+
+
+void inbin::commit()
+{
+    if (rp > rbase)
+        source->deq_bytes(rp - rbase);
+    rbase = rp = re = NULL;
+}
+
+
+void inbin::refill()
+{
+    commit();
+    memint count;
+    rbase = rp = source->get_tail(&count);
+    if (rp == NULL)
+        _bin_err();  // truncated
+    re = rp + count;
+}
+
+
+uinteger inbin::getuint()
+{
+    uinteger u = 0;
+    for (int shift = 0; shift < int(sizeof(uinteger)) * 8; shift += 7)
+    {
+        uchar c = getbyte();
+        u |= uinteger(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return u;
+    }
+    _bin_err();
+    return 0;
+}
+
+
+integer inbin::getint()
+{
+    uinteger u = getuint();
+    return integer((u >> 1) ^ (uinteger(0) - (u & 1)));
+}
+
+
+memint inbin::getlen()
+{
+    uinteger u = getuint();
+    if (u > uinteger(MEMINT_MAX))
+        _bin_err();
+    return memint(u);
+}
+
+
+void inbin::getraw(char* p, memint count)
+{
+    while (count > 0)
+    {
+        if (rp == re)
+            refill();
+        memint avail = re - rp;
+        if (count < avail)
+            avail = count;
+        memcpy(p, rp, avail);
+        rp += avail;
+        p += avail;
+        count -= avail;
+    }
+}
+
+
+void inbin::getitems(varvec& v, int depth)
+{
+    for (memint count = getlen(); count > 0; count--)
+    {
+        v.push_back(variant::null);
+        getvar(v.backw(), depth);
+    }
+}
+
+
+void inbin::getheader()
+{
+    char magic[binfmt::MAGIC_SIZE];
+    getraw(magic, binfmt::MAGIC_SIZE);
+    if (memcmp(magic, binfmt::MAGIC, binfmt::MAGIC_SIZE) != 0
+            || getbyte() != binfmt::VERSION)
+        _bin_err();
+}
+
+
+void inbin::getvar(variant& v, int depth)
+{
+    // Containers are decoded recursively, hence the limit
+    if (depth > binfmt::MAX_DEPTH)
+        _bin_err();
+    uchar tag = getbyte();
+    switch (tag)
+    {
+    case binfmt::NUL:
+        v.clear();
+        break;
+    case binfmt::ORD:
+        v = getint();
+        break;
+    case binfmt::STR:
+        {
+            str s;
+            for (memint count = getlen(); count > 0; )
+            {
+                if (rp == re)
+                    refill();
+                memint avail = re - rp;
+                if (count < avail)
+                    avail = count;
+                s.append(rp, avail);
+                rp += avail;
+                count -= avail;
+            }
+            v = s;
+        }
+        break;
+    case binfmt::RANGE:
+        {
+            integer l = getint();
+            integer r = getint();
+            v = variant(l, r);
+        }
+        break;
+    case binfmt::VEC:
+        {
+            varvec t;
+            getitems(t, depth + 1);
+            v = t;
+        }
+        break;
+    case binfmt::SET:
+        {
+            // Stored sorted, no need to search, but the order is checked
+            varset t;
+            getitems(t, depth + 1);
+            for (memint i = 1; i < t.size(); i++)
+                if (t[i - 1].compare(t[i]) >= 0)
+                    _bin_err();
+            v = t;
+        }
+        break;
+    case binfmt::ORDSET:
+        {
+            char bits[charset::BYTES];
+            getraw(bits, charset::BYTES);
+            ordset t;
+            for (int i = 0; i < charset::BITS; i++)
+                if (bits[i / 8] & (1 << (i % 8)))
+                    t.find_insert(i);
+            v = t;
+        }
+        break;
+    case binfmt::DICT:
+        {
+            vardict t;
+            variant key, val;
+            for (memint count = getlen(); count > 0; count--)
+            {
+                getvar(key, depth + 1);
+                getvar(val, depth + 1);
+                t.find_replace(key, val);
+            }
+            v = t;
+        }
+        break;
+    default:
+        _bin_err();
+    }
+}
+
+
+outbin::outbin(Type* rt, fifo* t) throw()
+    : buffifo(rt, false), target(t), ohead(0), started(false)
+{
+    varbuf.resize(BUF_VARS * _varsize);
+    buffer = (char*)varbuf.data();
+    bufsize = BUF_VARS * _varsize;
+}
+
+
+outbin::~outbin() throw()
+{
+    try
+        { flush(); }
+    catch (exception&)
+        { }
+    // Whatever is left if flush() failed
+    for (memint i = buftail; i < bufhead; i += _varsize)
+        ((variant*)(buffer + i))->~variant();
+}
+
+
+str outbin::get_name() const            { return target->get_name(); }
+
+
+variant* outbin::enq_var()
+{
+    if (bufhead == bufsize)
+        serialize();
+    return buffifo::enq_var();
+}
+
+
+void outbin::flush()
+{
+    serialize();
+    target->flush();
+}
+
+
+void outbin::serialize()
+{
+    // Variants are released as they are stored. A value that can't be
+    // stored is dropped before anything of it is written, so that the
+    // output stays valid and the remaining values can still be flushed.
+    while (buftail < bufhead)
+    {
+        variant* v = (variant*)(buffer + buftail);
+        bool ok = storable(*v, 0);
+        if (ok)
+        {
+            if (!started)
+            {
+                putraw(binfmt::MAGIC, binfmt::MAGIC_SIZE);
+                putbyte(binfmt::VERSION);
+                started = true;
+            }
+            putvar(*v);
+        }
+        v->~variant();
+        buftail += _varsize;
+        if (!ok)
+        {
+            putflush();
+            throw efifo("Value can't be stored in a binary fifo");
+        }
+    }
+    buftail = bufhead = 0;
+    putflush();
+}
+
+
+void outbin::putflush()
+{
+    if (ohead > 0)
+    {
+        target->enq(obuf, ohead);
+        ohead = 0;
+    }
+}
+
+
+void outbin::putuint(uinteger u)
+{
+    while (u >= 0x80)
+    {
+        putbyte(uchar(u | 0x80));
+        u >>= 7;
+    }
+    putbyte(uchar(u));
+}
+
+
+void outbin::putint(integer i)
+    { putuint((uinteger(i) << 1) ^ (i < 0 ? ~uinteger(0) : 0)); }
+
+
+void outbin::putraw(const char* p, memint count)
+{
+    if (count > OBUF_SIZE - ohead)
+    {
+        putflush();
+        if (count > OBUF_SIZE)
+        {
+            target->enq(p, count);
+            return;
+        }
+    }
+    memcpy(obuf + ohead, p, count);
+    ohead += count;
+}
+
+
+bool outbin::storable(const variant& v, int depth)
+{
+    // Same depth limit as in inbin::getvar()
+    if (depth > binfmt::MAX_DEPTH)
+        return false;
+    switch (v.getType())
+    {
+    case variant::VOID:
+    case variant::ORD:
+    case variant::STR:
+    case variant::RANGE:
+    case variant::ORDSET:
+        return true;
+    case variant::VEC:
+    case variant::SET:
+        {
+            const varvec& t = v.is(variant::SET) ? (const varvec&)v._set() : v._vec();
+            for (memint i = 0; i < t.size(); i++)
+                if (!storable(t[i], depth + 1))
+                    return false;
+        }
+        return true;
+    case variant::DICT:
+        {
+            const vardict& t = v._dict();
+            for (memint i = 0; i < t.size(); i++)
+                if (!storable(t.key(i), depth + 1) || !storable(t.value(i), depth + 1))
+                    return false;
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+void outbin::putvar(const variant& v)
+{
+    // Only called for values that are storable()
+    switch (v.getType())
+    {
+    case variant::VOID:
+        putbyte(binfmt::NUL);
+        break;
+    case variant::ORD:
+        putbyte(binfmt::ORD);
+        putint(v._int());
+        break;
+    case variant::STR:
+        {
+            putbyte(binfmt::STR);
+            const str& s = v._str();
+            putuint(s.size());
+            putraw(s.data(), s.size());
+        }
+        break;
+    case variant::RANGE:
+        {
+            putbyte(binfmt::RANGE);
+            const range& r = v._range();
+            putint(r.empty() ? 0 : r.left());
+            putint(r.empty() ? -1 : r.right());
+        }
+        break;
+    case variant::VEC:
+    case variant::SET:
+        {
+            putbyte(v.is(variant::SET) ? binfmt::SET : binfmt::VEC);
+            const varvec& t = v.is(variant::SET) ? (const varvec&)v._set() : v._vec();
+            putuint(t.size());
+            for (memint i = 0; i < t.size(); i++)
+                putvar(t[i]);
+        }
+        break;
+    case variant::ORDSET:
+        {
+            putbyte(binfmt::ORDSET);
+            const ordset& t = v._ordset();
+            char bits[charset::BYTES];
+            memset(bits, 0, charset::BYTES);
+            for (int i = 0; i < charset::BITS; i++)
+                if (t.find(i))
+                    bits[i / 8] |= char(1 << (i % 8));
+            putraw(bits, charset::BYTES);
+        }
+        break;
+    case variant::DICT:
+        {
+            putbyte(binfmt::DICT);
+            const vardict& t = v._dict();
+            putuint(t.size());
+            for (memint i = 0; i < t.size(); i++)
+            {
+                putvar(t.key(i));
+                putvar(t.value(i));
+            }
+        }
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
 
 
 // --- System utilities ---------------------------------------------------- //
@@ -1,8 +1,16 @@
 
 
+#include <signal.h>
+
 #include "runtime.h"
 #include "typesys.h"  // circular reference
 
+#if defined(SHN_SCAN16)
+#  include <tmmintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
 
 // --- charset ------------------------------------------------------------- //
 
@@ -93,6 +101,59 @@ void charset::assign(const charset& s) throw()
     { memcpy(data, s.data, BYTES); }
 
 
+// The 256-bit set operations below are done on two 128-bit halves with SSE2
+// where available (always on x86-64), otherwise on machine words. Similarly
+// scan() uses a 16-bytes-at-a-time SSSE3 kernel where SHN_SCAN16 is defined,
+// if the CPU has SSSE3; scaneol() needs SSE2 only.
+
+#ifdef __SSE2__
+
+#define LOAD_LO(d)  _mm_loadu_si128((const __m128i*)(d))
+#define LOAD_HI(d)  _mm_loadu_si128((const __m128i*)(d) + 1)
+#define STORE(d, lo, hi) \
+    { _mm_storeu_si128((__m128i*)(d), lo); _mm_storeu_si128((__m128i*)(d) + 1, hi); }
+
+
+bool charset::empty() const throw()
+{
+    __m128i z = _mm_or_si128(LOAD_LO(data), LOAD_HI(data));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(z, _mm_setzero_si128())) == 0xffff;
+}
+
+
+void charset::unite(const charset& s)
+    { STORE(data, _mm_or_si128(LOAD_LO(data), LOAD_LO(s.data)), _mm_or_si128(LOAD_HI(data), LOAD_HI(s.data))); }
+
+
+void charset::subtract(const charset& s)
+    { STORE(data, _mm_andnot_si128(LOAD_LO(s.data), LOAD_LO(data)), _mm_andnot_si128(LOAD_HI(s.data), LOAD_HI(data))); }
+
+
+void charset::intersect(const charset& s)
+    { STORE(data, _mm_and_si128(LOAD_LO(data), LOAD_LO(s.data)), _mm_and_si128(LOAD_HI(data), LOAD_HI(s.data))); }
+
+
+void charset::invert()
+{
+    __m128i ones = _mm_set1_epi8(-1);
+    STORE(data, _mm_xor_si128(LOAD_LO(data), ones), _mm_xor_si128(LOAD_HI(data), ones));
+}
+
+
+bool charset::le(const charset& s) const
+{
+    // this is a subset of s if (this & ~s) is empty
+    __m128i z = _mm_or_si128(_mm_andnot_si128(LOAD_LO(s.data), LOAD_LO(data)),
+        _mm_andnot_si128(LOAD_HI(s.data), LOAD_HI(data)));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(z, _mm_setzero_si128())) == 0xffff;
+}
+
+#undef LOAD_LO
+#undef LOAD_HI
+#undef STORE
+
+#else // __SSE2__
+
 bool charset::empty() const throw()
 {
     for(int i = 0; i < WORDS; i++) 
@@ -142,6 +203,149 @@ bool charset::le(const charset& s) const
     return true;
 }
 
+#endif // __SSE2__
+
+
+#ifdef SHN_SCAN16
+
+// Nibble-table membership test: for a byte x = (h << 4) | l the table row
+// lo[l] (h < 8) or hi[l] (h >= 8) holds the bits for all 8 possible values
+// of h & 7, so that one shuffle by l and another one by h give the answer
+// for 16 bytes at once. Tables are built on demand and kept for the last few
+// sets scanned, which are usually the same ones over and over again.
+
+struct scantables
+{
+    uchar set[charset::BYTES];
+    uchar lo[16];
+    uchar hi[16];
+};
+
+enum { SCAN_CACHE = 4 };
+
+#ifdef SHN_THR
+static __thread scantables _scancache[SCAN_CACHE];  // all zero: the empty set
+static __thread int _scannext;
+#else
+static scantables _scancache[SCAN_CACHE];
+static int _scannext;
+#endif
+
+
+static const scantables* scantables_for(const uchar* set)
+{
+    for (int i = 0; i < SCAN_CACHE; i++)
+        if (memcmp(_scancache[i].set, set, charset::BYTES) == 0)
+            return &_scancache[i];
+    scantables* t = &_scancache[_scannext];
+    _scannext = (_scannext + 1) % SCAN_CACHE;
+    memcpy(t->set, set, charset::BYTES);
+    for (int l = 0; l < 16; l++)
+    {
+        // The bit for (h << 4) | l is bit l % 8 of set[h * 2 + l / 8]
+        uchar a = 0, b = 0;
+        for (int h = 0; h < 8; h++)
+        {
+            a |= uchar(((set[h * 2 + l / 8] >> (l % 8)) & 1) << h);
+            b |= uchar(((set[16 + h * 2 + l / 8] >> (l % 8)) & 1) << h);
+        }
+        t->lo[l] = a;
+        t->hi[l] = b;
+    }
+    return t;
+}
+
+
+#ifdef __SSSE3__
+#  define has_ssse3 true
+#else
+static bool cpu_ssse3()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+static const bool has_ssse3 = cpu_ssse3();
+
+__attribute__((target("ssse3")))
+#endif
+const char* charset::_scan16(const char* p, const char* e) const
+{
+    const scantables* t = scantables_for(data);
+    const __m128i tlo = _mm_loadu_si128((const __m128i*)t->lo);
+    const __m128i thi = _mm_loadu_si128((const __m128i*)t->hi);
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+        1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i nib = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+    for ( ; e - p >= 16; p += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        __m128i l = _mm_and_si128(x, nib);
+        __m128i h = _mm_and_si128(_mm_srli_epi16(x, 4), nib);
+        __m128i upper = _mm_cmplt_epi8(x, zero);  // h >= 8
+        __m128i row = _mm_or_si128(_mm_and_si128(upper, _mm_shuffle_epi8(thi, l)),
+            _mm_andnot_si128(upper, _mm_shuffle_epi8(tlo, l)));
+        __m128i bit = _mm_shuffle_epi8(bits, h);
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
+        if (m != 0xffff)
+            return p + __builtin_ctz(~m);
+    }
+    return p;
+}
+
+#endif // SHN_SCAN16
+
+
+const char* charset::scan(const char* p, const char* e) const
+{
+    // Most tokens are short, so check a few bytes before going wide
+    const char* e0 = e - p > 16 ? p + 16 : e;
+    for ( ; p < e0; p++)
+        if (!contains(*p))
+            return p;
+#ifdef SHN_SCAN16
+    if (e - p >= 16 && has_ssse3)
+        p = _scan16(p, e);
+#endif
+    for ( ; e - p >= 4; p += 4)
+    {
+        if (!contains(p[0])) return p;
+        if (!contains(p[1])) return p + 1;
+        if (!contains(p[2])) return p + 2;
+        if (!contains(p[3])) return p + 3;
+    }
+    while (p < e && contains(*p))
+        p++;
+    return p;
+}
+
+
+const char* scaneol(const char* p, const char* e)
+{
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for ( ; e - p >= 16; p += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)p);
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, cr), _mm_cmpeq_epi8(x, lf)));
+        if (m != 0)
+            return p + __builtin_ctz(m);
+    }
+    for ( ; p < e; p++)
+        if (*p == '\r' || *p == '\n')
+            return p;
+    return e;
+#else
+    const char* n = (const char*)memchr(p, '\n', e - p);
+    if (n == NULL)
+        n = e;
+    const char* r = (const char*)memchr(p, '\r', n - p);
+    return r != NULL ? r : n;
+#endif
+}
+
 
 // --- object -------------------------------------------------------------- //
 
@@ -152,26 +356,139 @@ atomicint object::allocated = 0;
 object::~object() throw()  { }
 
 
-void _del_obj(object* o)
+struct delqueue
 {
+    object** items;
+    memint count;
+    memint capacity;
+    memint step;
+};
+
+#ifdef SHN_THR
+static __thread delqueue _delq;
+#else
+static delqueue _delq;
+#endif
+
+
+void _free_obj(object* o)
+{
+#ifndef SHN_THR
+    // A state object's block goes back to its type for reuse, provided the
+    // object wasn't collapsed earlier
+    if (o->_gcflags & object::GC_RTOBJ)
+    {
+        Type* t = ((rtobject*)o)->getType();
+        if (t != NULL && t->isAnyState())
+        {
+            o->~object();
+            if (((State*)t)->recycleInstance(o))
+            {
+#ifdef DEBUG
+                pdecrement(&object::allocated);
+#endif
+            }
+            else
+                object::operator delete(o);
+            return;
+        }
+    }
+#endif
     delete o;
 }
 
 
+void _del_obj(object* o)
+{
+    delqueue& q = _delq;
+    if (q.step == 0)
+    {
+        _free_obj(o);
+        return;
+    }
+    if (q.count == q.capacity)
+    {
+        q.capacity = q.capacity == 0 ? 256 : q.capacity * 2;
+        q.items = (object**)pmemrealloc(q.items, q.capacity * sizeof(object*));
+    }
+    q.items[q.count++] = o;
+}
+
+
+memint freedeferred(memint max)
+{
+    delqueue& q = _delq;
+    memint done = 0;
+    while (q.count > 0 && done != max)
+    {
+        // Objects released by this destructor are pushed onto the queue
+        _free_obj(q.items[--q.count]);
+        done++;
+    }
+    return done;
+}
+
+
+void freedeferredstep()
+{
+    if (_delq.count > 0)
+        freedeferred(_delq.step);
+}
+
+
+void deferfree(memint step)
+{
+    delqueue& q = _delq;
+    if (step == 0)
+    {
+        freedeferred(-1);
+        pmemfree(q.items);
+        q.items = NULL;
+        q.capacity = 0;
+    }
+    q.step = step;
+}
+
+
+memint deferredcount()
+    { return _delq.count; }
+
+
 #ifndef SHN_FASTER
 atomicint object::release() throw()
 {
     if (this == NULL)
         return 0;
     assert(_refcount > 0);
-    atomicint r = pdecrement(&_refcount);
+    atomicint r = _decref();
     if (r == 0)
-        _del_obj(this);
+    {
+        if (_gcflags & GC_BUFFERED)
+            _gc_finalize(this);
+        else
+            _del_obj(this);
+    }
+    else if (_gcflags & GC_TRACKED)
+        _gc_root(this);
     return r;
 }
 #endif
 
 
+#ifdef SHN_THR
+void object::share()
+{
+    if (!_shared)
+    {
+        _shared = true;
+        // Make the flag and the object's contents visible to other threads
+        // before the pointer itself is published
+        pfence();
+    }
+}
+#endif
+
+
 void object::_assignto(object*& p) throw()
 {
     if (p != this)
@@ -187,6 +504,18 @@ void object::_assignto(object*& p) throw()
 void* object::operator new(size_t self)
 {
     void* p = ::pmemalloc(self);
+    heapalloc(HEAP_OBJ, self);
+#ifdef DEBUG
+    pincrement(&object::allocated);
+#endif
+    return p;
+}
+
+
+void* object::_arena_new(size_t self)
+{
+    void* p = ::pmemarena_alloc(self);
+    heapalloc(HEAP_OBJ, self);
 #ifdef DEBUG
     pincrement(&object::allocated);
 #endif
@@ -225,6 +554,10 @@ object* object::_dup(size_t self, memint extra)
 #endif    
     memcpy(o, this, self);
     o->_refcount = 0;
+    o->_gcflags = 0;
+#ifdef SHN_THR
+    o->_shared = false;
+#endif
     return o;
 }
 
@@ -274,6 +607,7 @@ container* container::allocate(memint cap, memint siz) throw()
     assert(siz >= 0);
     if (cap == 0)
         return NULL;
+    heapalloc(HEAP_STR, sizeof(container) + cap);
     return new(cap) container(cap, siz);
 }
 
@@ -302,6 +636,7 @@ container* container::reallocate(container* p, memint newsize)
     p->_capacity = newsize > p->_capacity ? _calc_prealloc(newsize) : newsize;
     if (p->_capacity <= 0)
         overflow();
+    heapalloc(HEAP_GROW, sizeof(*p) + p->_capacity);
     p->_size = newsize;
     return (container*)object::reallocate(p, sizeof(*p), p->_capacity);
 }
@@ -311,7 +646,9 @@ container* container::_dup(memint cap, memint siz)
 {
     assert(cap > 0);
     assert(siz > 0 && siz <= cap);
+    heapalloc(HEAP_GROW, sizeof(container) + cap);
     container* c = (container*)object::_dup(sizeof(container), cap);
+    c->_flags = 0;
     c->_capacity = cap;
     c->_size = siz;
     return c;
@@ -339,15 +676,18 @@ char* bytevec::_init(memint len) throw()
 
 void bytevec::_init(memint len, char fill) throw()
 {
+    // Note: _init(0) should still be called to reset obj, e.g. after _fin()
+    char* p = _init(len);
     if (len)
-        ::memset(_init(len), fill, len);
+        ::memset(p, fill, len);
 }
 
 
 void bytevec::_init(const char* buf, memint len) throw()
 {
+    char* p = _init(len);
     if (len)
-        ::memcpy(_init(len), buf, len);
+        ::memcpy(p, buf, len);
 }
 
 
@@ -379,13 +719,9 @@ void bytevec::assign(const char* buf, memint len)
 
 void bytevec::clear()
 {
-    if (!empty())
-    {
-        // finalize() is not needed for POD data, but we put it here so that clear() works
-        // for descendant non-POD containers. Same applies to insert()/append().
-        obj->finalize(obj->data(), obj->size());
-        obj.clear();
-    }
+    // Non-POD containers finalize their data in the destructor, and only once
+    // the last reference is released; the data may be shared at this point.
+    obj.clear();
 }
 
 
@@ -663,6 +999,17 @@ bool str::operator== (const char* s) const
     { return compare(s, pstrlen(s)) == 0; }
 
 
+bool str::operator== (const str& s) const
+{
+    if (obj.get() == s.obj.get())
+        return true;
+    // Two different interned objects can't be equal
+    if (isinterned() && s.isinterned())
+        return false;
+    return compare(s.data(), s.size()) == 0;
+}
+
+
 void str::operator+= (const char* s)
     { append(s, pstrlen(s)); }
 
@@ -678,6 +1025,33 @@ void str::replace(memint pos, memint len, const str& s)
 }
 
 
+hashint str::hash() const
+{
+    return empty() ? memhash(NULL, 0) : memhash(data(), size());
+}
+
+
+// The intern table: sorted, holds a reference to each interned string.
+// Mutating an interned string always creates a copy since the table is one
+// of the owners.
+static strvec internTable;
+
+
+void str::intern()
+{
+    if (empty() || obj->isinterned())
+        return;
+    memint i;
+    if (internTable.bsearch(*this, i))
+        *this = internTable[i];
+    else
+    {
+        obj->_setinterned();
+        internTable.insert(i, *this);
+    }
+}
+
+
 str str::substr(memint pos, memint len) const
 {
     if (pos == 0 && len == size())
@@ -1130,6 +1504,7 @@ void nullptrerr()
 
 // --- variant ------------------------------------------------------------- //
 
+
 /*
 template class vector<variant>;
 template class set<variant>;
@@ -1183,11 +1558,23 @@ memint variant::compare(const variant& v) const
             return _str().compare(v._str());
         case RANGE:
             return _range().compare(v._range());
-        // TODO: define "deep" comparison, at least for vectors?
         case VEC:
+            return _cmpvec(_vec(), v._vec());
         case SET:
+            return _cmpvec(_set(), v._set());
         case ORDSET:
+            return _ordset().compare(v._ordset());
         case DICT:
+            {
+                const vardict& a = _dict();
+                const vardict& b = v._dict();
+                if (a.obj.get() == b.obj.get())
+                    return 0;
+                if (a.empty() || b.empty())
+                    return a.size() - b.size();
+                memint d = _cmpvec(a.obj->keys, b.obj->keys);
+                return d != 0 ? d : _cmpvec(a.obj->values, b.obj->values);
+            }
         case REF:
         case RTOBJ:
             return memint(_anyobj()) - memint(v._anyobj());
@@ -1209,10 +1596,20 @@ bool variant::operator== (const variant& v) const
             case VARPTR:    return val._ptr == v.val._ptr;
             case STR:       return _str() == v._str();
             case RANGE:     return _range() == v._range();
-            case VEC:       return _vec() == v._vec();
-            case SET:       return _set() == v._set();
+            case VEC:       return _eqvec(_vec(), v._vec());
+            case SET:       return _eqvec(_set(), v._set());
             case ORDSET:    return _ordset() == v._ordset();
-            case DICT:      return _dict() == v._dict();
+            case DICT:
+                {
+                    const vardict& a = _dict();
+                    const vardict& b = v._dict();
+                    if (a.obj.get() == b.obj.get())
+                        return true;
+                    if (a.size() != b.size())
+                        return false;
+                    return _eqvec(a.obj->keys, b.obj->keys)
+                        && _eqvec(a.obj->values, b.obj->values);
+                }
             case REF:       return _ref() == v._ref();
             case RTOBJ:     return _rtobj() == v._rtobj();
         }
@@ -1221,6 +1618,148 @@ bool variant::operator== (const variant& v) const
 }
 
 
+hashint variant::_hashvec(const varvec& v)
+{
+    hashint h = hashint(v.size());
+    for (memint i = 0; i < v.size(); i++)
+        h = hashmix(h, v[i].hash());
+    return h;
+}
+
+
+// Deep lexicographic comparison of vectors and sets; sets are sorted so this
+// works for them too
+
+memint variant::_cmpvec(const varvec& a, const varvec& b)
+{
+    if (a == b)
+        return 0;
+    memint n = imin(a.size(), b.size());
+    for (memint i = 0; i < n; i++)
+    {
+        memint d = a[i].compare(b[i]);
+        if (d != 0)
+            return d;
+    }
+    return a.size() - b.size();
+}
+
+
+bool variant::_eqvec(const varvec& a, const varvec& b)
+{
+    if (a == b)
+        return true;
+    memint n = a.size();
+    if (n != b.size())
+        return false;
+    for (memint i = 0; i < n; i++)
+        if (a[i] != b[i])
+            return false;
+    return true;
+}
+
+
+hashint variant::hash() const
+{
+    switch(type)
+    {
+    case VOID:
+        return 0;
+    case ORD:
+        return inthash(val._ord);
+    case REAL:
+        // +0.0 and -0.0 are equal, should have the same hash
+        return val._real == 0 ? 0 : memhash(&val._real, sizeof(real));
+    case VARPTR:
+        return inthash(memint(val._ptr));
+    case STR:
+        return _str().hash();
+    case RANGE:
+        {
+            const range& r = _range();
+            return r.empty() ? 0 : hashmix(inthash(r.left()), inthash(r.right()));
+        }
+    case VEC:
+        return _hashvec(_vec());
+    case SET:
+        return _hashvec(_set());
+    case ORDSET:
+        return _ordset().get_charset().hash();
+    case DICT:
+        {
+            const vardict& d = _dict();
+            if (d.empty())
+                return 0;
+            return hashmix(_hashvec(d.obj->keys), _hashvec(d.obj->values));
+        }
+    case REF:
+    case RTOBJ:
+        return inthash(memint(_anyobj()));
+    }
+    return 0;
+}
+
+
+void variant::_sharevec(const varvec& v)
+{
+    if (v.empty())
+        return;
+    ((const bytevec&)v).obj->share();
+    for (memint i = 0; i < v.size(); i++)
+        v[i].share();
+}
+
+
+// Shares the value graph reachable from this variant at the time of the call.
+// Objects that are already shared are assumed to have their contents shared
+// too, which also stops the walk at cyclic references. This does not hold for
+// a value stored into a shared object later: calling share() on the container
+// again returns early, so the value itself must be shared before it is stored.
+
+void variant::share() const
+{
+#ifdef SHN_THR
+    if (!is_anyobj() || val._obj == NULL || val._obj->isshared())
+        return;
+    val._obj->share();
+    switch(type)
+    {
+    case VEC:
+        _sharevec(_vec());
+        break;
+    case SET:
+        _sharevec(_set());
+        break;
+    case DICT:
+        _sharevec(_dict().obj->keys);
+        _sharevec(_dict().obj->values);
+        break;
+    case REF:
+        val._ref->var.share();
+        break;
+    case RTOBJ:
+        {
+            ::Type* t = val._rtobj->getType();
+            if (t == NULL)
+                ;
+            else if (t->isAnyState())
+            {
+                stateobj* o = _stateobj();
+                for (memint i = ((State*)t)->varCount; i--; )
+                    o->member(i)->share();
+            }
+            else if (t->isFuncPtr())
+                // A nested function's pointer carries its outer object
+                variant(RTOBJ, _funcptr()->outer.get()).share();
+        }
+        break;
+    default:
+        break;
+    }
+#endif
+}
+
+
 bool variant::empty() const
 {
     switch(type)
@@ -1272,12 +1811,13 @@ void stateobj::dump(fifo& stm) const
 
 void stateobj::collapse()
 {
-    // TODO: this is not thread-safe. An atomic exchnage for pointers is needed.
-    if (getType() != NULL)
+    // The type is taken atomically so that the members are released only
+    // once even if several threads collapse the object at the same time
+    State* t = (State*)clearType();
+    if (t != NULL)
     {
-        for (memint count = getType()->varCount; count--; )
+        for (memint count = t->varCount; count--; )
             member(count)->clear();
-        clearType();
 #ifdef DEBUG
         varcount = 0;
 #endif
@@ -1286,7 +1826,8 @@ void stateobj::collapse()
 
 
 funcptr::funcptr(stateobj* d, stateobj* o, State* s) throw()
-    : rtobject(s->prototype), dataseg(d), outer(o), state(s)  { }
+    : rtobject(s->prototype), dataseg(d), outer(o), state(s)
+        { _gctrack(GC_RTOBJ); }
 
 funcptr::~funcptr() throw()
     { }
@@ -1309,6 +1850,620 @@ rtstack::rtstack(memint maxSize) throw()
 }
 
 
+// --- cycle collector ----------------------------------------------------- //
+
+
+// Nodes of the object graph are objects along with their kind, i.e. the
+// variant type they were referred by: containers of vectors and sets, dict
+// objects, references and runtime objects. Strings, ranges and ordsets can't
+// refer to other objects and aren't visited. The algorithm is iterative and
+// temporarily modifies the refcounts of the visited objects, as in the
+// original paper.
+
+enum { GC_BLACK = 0, GC_GRAY = 1, GC_WHITE = 2, GC_ROOTS_STEP = 10000 };
+
+
+struct gcnode
+{
+    object* obj;
+    variant::Type kind;
+    gcnode(object* o, variant::Type k): obj(o), kind(k)  { }
+};
+
+
+struct cyclecollector
+{
+    podvec<object*> roots;
+    bool tracking;
+    memint collections;
+    memint reclaimed;
+
+    podvec<gcnode> stack;
+    podvec<gcnode> whites;
+
+    static int color(object* o)
+        { return o->_gcflags & object::GC_COLOR; }
+    static void setcolor(object* o, int c)
+        { o->_gcflags = uchar((o->_gcflags & ~object::GC_COLOR) | c); }
+    static void edge(podvec<gcnode>&, const variant&);
+    static void edge(podvec<gcnode>&, const bytevec&);
+    static void children(const gcnode&, podvec<gcnode>&);
+
+    void markgray(const gcnode&);
+    void scan(const gcnode&);
+    void scanblack(const gcnode&);
+    void collectwhite(const gcnode&);
+    memint collect();
+};
+
+
+#ifdef SHN_THR
+
+static __thread cyclecollector* _thrgc;
+
+static cyclecollector& gc_instance()
+{
+    // Never freed, same as the pool caches
+    if (_thrgc == NULL)
+        _thrgc = new(pmemcalloc(sizeof(cyclecollector))) cyclecollector();
+    return *_thrgc;
+}
+
+#else
+
+static cyclecollector _gc;
+
+static inline cyclecollector& gc_instance()
+    { return _gc; }
+
+#endif
+
+
+void cyclecollector::edge(podvec<gcnode>& out, const variant& v)
+{
+    switch (v.getType())
+    {
+    case variant::VEC:
+    case variant::SET:
+    case variant::DICT:
+    case variant::REF:
+    case variant::RTOBJ:
+        // Shared objects can be modified by other threads at any time
+        if (v._anyobj() != NULL && !v._anyobj()->isshared())
+            out.push_back(gcnode(v._anyobj(), v.getType()));
+        break;
+    default:
+        break;
+    }
+}
+
+
+void cyclecollector::edge(podvec<gcnode>& out, const bytevec& v)
+{
+    if (!v.empty() && !v.obj->isshared())
+        out.push_back(gcnode(v.obj, variant::VEC));
+}
+
+
+void cyclecollector::children(const gcnode& n, podvec<gcnode>& out)
+{
+    switch (n.kind)
+    {
+    case variant::VEC:
+    case variant::SET:
+        {
+            container* c = (container*)n.obj;
+            for (variant* v = (variant*)c->data(); v < (variant*)c->end(); v++)
+                edge(out, *v);
+        }
+        break;
+    case variant::DICT:
+        {
+            vardict::dictobj* d = (vardict::dictobj*)n.obj;
+            edge(out, (const bytevec&)d->keys);
+            edge(out, (const bytevec&)d->values);
+        }
+        break;
+    case variant::REF:
+        edge(out, ((reference*)n.obj)->var);
+        break;
+    case variant::RTOBJ:
+        {
+            Type* t = ((rtobject*)n.obj)->getType();
+            if (t == NULL)
+                break;
+            if (t->isAnyState())
+            {
+                stateobj* o = (stateobj*)n.obj;
+                for (memint i = ((State*)t)->varCount; i--; )
+                    edge(out, *o->member(i));
+            }
+            else if (t->isFuncPtr())
+            {
+                funcptr* f = (funcptr*)n.obj;
+                if (!f->outer.empty() && !f->outer->isshared())
+                    out.push_back(gcnode(f->outer, variant::RTOBJ));
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+// Subtract internal references, i.e. the ones within the subgraph
+void cyclecollector::markgray(const gcnode& root)
+{
+    if (color(root.obj) == GC_GRAY)
+        return;
+    setcolor(root.obj, GC_GRAY);
+    stack.push_back(root);
+    while (!stack.empty())
+    {
+        gcnode n = stack.back();
+        stack.pop_back();
+        memint first = stack.size();
+        children(n, stack);
+        // Visit each gray node's children only once
+        for (memint i = stack.size(); i-- > first; )
+        {
+            object* o = stack[i].obj;
+            o->_refcount--;
+            if (color(o) == GC_GRAY)
+                stack.erase(i);
+            else
+                setcolor(o, GC_GRAY);
+        }
+    }
+}
+
+
+// Nodes with references from outside are live along with everything they
+// refer to, the rest is garbage
+void cyclecollector::scan(const gcnode& root)
+{
+    stack.push_back(root);
+    while (!stack.empty())
+    {
+        gcnode n = stack.back();
+        stack.pop_back();
+        if (color(n.obj) != GC_GRAY)
+            continue;
+        if (n.obj->_refcount > 0)
+            scanblack(n);
+        else
+        {
+            setcolor(n.obj, GC_WHITE);
+            children(n, stack);
+        }
+    }
+}
+
+
+// Restore the refcounts of everything reachable from a live node
+void cyclecollector::scanblack(const gcnode& root)
+{
+    podvec<gcnode> black;
+    setcolor(root.obj, GC_BLACK);
+    black.push_back(root);
+    while (!black.empty())
+    {
+        gcnode n = black.back();
+        black.pop_back();
+        memint first = black.size();
+        children(n, black);
+        for (memint i = black.size(); i-- > first; )
+        {
+            object* o = black[i].obj;
+            o->_refcount++;
+            if (color(o) == GC_BLACK)
+                black.erase(i);
+            else
+                setcolor(o, GC_BLACK);
+        }
+    }
+}
+
+
+// Collect white nodes and restore the refcounts of their references
+void cyclecollector::collectwhite(const gcnode& root)
+{
+    if (color(root.obj) != GC_WHITE)
+        return;
+    setcolor(root.obj, GC_BLACK);
+    stack.push_back(root);
+    while (!stack.empty())
+    {
+        gcnode n = stack.back();
+        stack.pop_back();
+        whites.push_back(n);
+        memint first = stack.size();
+        children(n, stack);
+        for (memint i = stack.size(); i-- > first; )
+        {
+            object* o = stack[i].obj;
+            o->_refcount++;
+            if (color(o) != GC_WHITE)
+                stack.erase(i);
+            else
+                setcolor(o, GC_BLACK);
+        }
+    }
+}
+
+
+memint cyclecollector::collect()
+{
+    if (roots.empty())
+        return 0;
+    collections++;
+
+    // Objects released during collection start a new buffer
+    podvec<object*> r = roots;
+    roots.clear();
+
+    // Roots that dropped to zero are freed at the end, see below
+    podvec<gcnode> live;
+    for (memint i = 0; i < r.size(); i++)
+        if (r[i]->_refcount > 0)
+            live.push_back(gcnode(r[i], r[i]->_gcflags & object::GC_REF ?
+                variant::REF : variant::RTOBJ));
+    for (memint i = 0; i < live.size(); i++)
+        markgray(live[i]);
+    for (memint i = 0; i < live.size(); i++)
+        scan(live[i]);
+    for (memint i = 0; i < live.size(); i++)
+        collectwhite(live[i]);
+
+    // All refcounts are real again; break the cycles by clearing the
+    // objects' variables, which frees everything else
+    memint count = whites.size();
+    for (memint i = 0; i < count; i++)
+        whites[i].obj->grab();
+    for (memint i = 0; i < count; i++)
+    {
+        const gcnode& n = whites[i];
+        if (n.kind == variant::REF)
+            ((reference*)n.obj)->var.clear();
+        else if (n.kind == variant::RTOBJ)
+        {
+            Type* t = ((rtobject*)n.obj)->getType();
+            if (t == NULL)
+                ;
+            else if (t->isAnyState())
+                ((stateobj*)n.obj)->collapse();
+            else if (t->isFuncPtr())
+                ((funcptr*)n.obj)->outer.clear();
+        }
+    }
+    for (memint i = 0; i < count; i++)
+        whites[i].obj->release();
+    whites.clear();
+    reclaimed += count;
+
+    // A root freed here may release roots further in the list, which are
+    // still buffered and thus remain to be freed by this loop
+    for (memint i = 0; i < r.size(); i++)
+    {
+        object* o = r[i];
+        o->_gcflags &= ~object::GC_BUFFERED;
+        if (o->_refcount == 0)
+            _del_obj(o);
+    }
+    return count;
+}
+
+
+void _gc_root(object* o)
+{
+    if (o->isshared() || (o->_gcflags & object::GC_BUFFERED))
+        return;
+    cyclecollector& gc = gc_instance();
+    if (gc.tracking)
+    {
+        o->_gcflags |= object::GC_BUFFERED;
+        gc.roots.push_back(o);
+    }
+}
+
+
+void _gc_finalize(object* o)
+{
+    // The block is still in the roots buffer and can't be freed until the
+    // next collection, but whatever the object refers to should be released
+    // now: destroy it and leave a bare buffered object for collect() to free
+    o->~object();
+    ::new(o) object();
+    o->_gcflags = object::GC_BUFFERED;
+}
+
+
+void trackcycles(bool enable)
+{
+    // Collection may buffer new roots, which should all be processed before
+    // tracking is off
+    cyclecollector& gc = gc_instance();
+    if (!enable)
+        while (!gc.roots.empty())
+            gc.collect();
+    gc.tracking = enable;
+}
+
+
+memint collectcycles()
+    { return gc_instance().collect(); }
+
+
+void collectcyclesstep()
+{
+    cyclecollector& gc = gc_instance();
+    if (gc.roots.size() >= GC_ROOTS_STEP)
+        gc.collect();
+}
+
+
+void cyclestats(FILE* f)
+{
+    // Statistics of the calling thread
+    cyclecollector& gc = gc_instance();
+    fprintf(f, "cycle collections: %ld  objects reclaimed: %ld\n",
+        long(gc.collections), long(gc.reclaimed));
+}
+
+
+// --- heap profiler ------------------------------------------------------- //
+
+
+// The counters are shared by all threads and are updated atomically. States
+// are kept in a small open-addressed table, the ones that don't fit are
+// counted together. Samples go to a ring buffer, they are aggregated by call
+// stack when dumped.
+
+enum { HEAP_STATES = 256, HEAP_SAMPLES = 4096, HEAP_DEPTH = 8 };
+
+
+struct heapcounter
+{
+    memint count;
+    memint bytes;
+    void add(memint size)  { pincrement(&count); padd(&bytes, size); }
+};
+
+
+struct heapstate
+{
+    State* state;
+    heapcounter cnt;
+};
+
+
+struct heapsample
+{
+    HeapKind kind;
+    memint size;
+    memint depth;
+    struct { State* state; integer line; } frames[HEAP_DEPTH];
+};
+
+
+struct heapsite
+{
+    const heapsample* sample;
+    memint count;
+    memint bytes;
+};
+
+
+static const char* heapKindNames[HEAP_KINDS] =
+    { "object", "str", "vec", "copy/grow", "state", "fifo chunk" };
+
+bool _heapprof = false;
+volatile int _heapdumpreq = 0;
+
+#ifdef SHN_THR
+__thread vmframe* _vmtop;
+#else
+vmframe* _vmtop;
+#endif
+
+static memint _heapperiod;
+static memint _heaptick;
+static memint _heaptaken;
+static heapcounter _heapkinds[HEAP_KINDS];
+static heapstate _heapstates[HEAP_STATES];
+static heapcounter _heapotherstates;
+static heapsample _heapsamples[HEAP_SAMPLES];
+static const char* _heapdumppath;
+
+
+static heapcounter& heap_state(State* s)
+{
+    memint h = memint(uintptr_t(s) >> 4);
+    for (memint i = 0; i < HEAP_STATES; i++, h++)
+    {
+        heapstate& e = _heapstates[h & (HEAP_STATES - 1)];
+        if (pload(&e.state) == NULL)
+            pcompareexchange(&e.state, (State*)NULL, s);
+        if (pload(&e.state) == s)
+            return e.cnt;
+    }
+    return _heapotherstates;
+}
+
+
+static void heap_sample(HeapKind k, memint size)
+{
+    heapsample& smp = _heapsamples[(pincrement(&_heaptaken) - 1) % HEAP_SAMPLES];
+    smp.kind = k;
+    smp.size = size;
+    memint d = 0;
+    for (vmframe* f = _vmtop; f != NULL && d < HEAP_DEPTH; f = f->prev, d++)
+    {
+        smp.frames[d].state = f->state;
+        smp.frames[d].line = f->line;
+    }
+    smp.depth = d;
+}
+
+
+void _heap_alloc(HeapKind k, memint size, State* s)
+{
+    _heapkinds[k].add(size);
+    if (s != NULL)
+        heap_state(s).add(size);
+    if (_heapperiod > 0 && pincrement(&_heaptick) % _heapperiod == 0)
+        heap_sample(k, size);
+}
+
+
+void heapprofile(bool on, memint period)
+{
+    // The period is kept when switching off, for the report
+    if (on)
+        _heapperiod = period > 0 ? period : 0;
+    _heapprof = on;
+}
+
+
+static bool samestack(const heapsample& a, const heapsample& b)
+{
+    if (a.depth != b.depth)
+        return false;
+    for (memint i = 0; i < a.depth; i++)
+        if (a.frames[i].state != b.frames[i].state || a.frames[i].line != b.frames[i].line)
+            return false;
+    return true;
+}
+
+
+static void heap_statename(FILE* f, State* s)
+{
+    if (s == NULL)
+    {
+        fputs("<const>", f);
+        return;
+    }
+    strfifo name(NULL);
+    s->fqName(name);
+    fputs(name.all().c_str(), f);
+}
+
+
+void heapdump(FILE* f)
+{
+    // The dump itself allocates
+    bool on = _heapprof;
+    _heapprof = false;
+
+    fprintf(f, "%12s %14s  %s\n", "allocs", "bytes", "kind");
+    for (memint k = 0; k < HEAP_KINDS; k++)
+        if (_heapkinds[k].count)
+            fprintf(f, "%12ld %14ld  %s\n", long(_heapkinds[k].count),
+                long(_heapkinds[k].bytes), heapKindNames[k]);
+
+    // States, heaviest first
+    podvec<heapstate*> states;
+    for (memint i = 0; i < HEAP_STATES; i++)
+    {
+        heapstate* e = &_heapstates[i];
+        if (e->state == NULL || e->cnt.count == 0)
+            continue;
+        memint j = 0;
+        while (j < states.size() && states[j]->cnt.bytes >= e->cnt.bytes)
+            j++;
+        states.insert(j, e);
+    }
+    if (!states.empty())
+        fprintf(f, "\n%12s %14s  %s\n", "allocs", "bytes", "state");
+    for (memint i = 0; i < states.size(); i++)
+    {
+        fprintf(f, "%12ld %14ld  ", long(states[i]->cnt.count), long(states[i]->cnt.bytes));
+        heap_statename(f, states[i]->state);
+        fputc('\n', f);
+    }
+    if (_heapotherstates.count)
+        fprintf(f, "%12ld %14ld  <other>\n", long(_heapotherstates.count),
+            long(_heapotherstates.bytes));
+
+    // Sampled call stacks, heaviest first
+    memint taken = _heaptaken;
+    memint n = taken < HEAP_SAMPLES ? taken : memint(HEAP_SAMPLES);
+    podvec<heapsite> sites;
+    for (memint i = 0; i < n; i++)
+    {
+        const heapsample& smp = _heapsamples[i];
+        memint j = 0;
+        while (j < sites.size() && !samestack(*sites[j].sample, smp))
+            j++;
+        if (j == sites.size())
+        {
+            heapsite site = { &smp, 0, 0 };
+            sites.push_back(site);
+        }
+        sites.atw(j).count++;
+        sites.atw(j).bytes += smp.size;
+    }
+    for (memint i = 1; i < sites.size(); i++)
+        for (memint j = i; j > 0 && sites[j - 1].bytes < sites[j].bytes; j--)
+        {
+            heapsite t = sites[j];
+            sites.replace(j, sites[j - 1]);
+            sites.replace(j - 1, t);
+        }
+    if (taken)
+        fprintf(f, "\n%ld samples, one per %ld allocations, last %ld shown\n",
+            long(taken), long(_heapperiod), long(n));
+    for (memint i = 0; i < sites.size(); i++)
+    {
+        const heapsample& smp = *sites[i].sample;
+        fprintf(f, "\n%12ld %14ld\n", long(sites[i].count), long(sites[i].bytes));
+        if (smp.depth == 0)
+            fputs("    <runtime>\n", f);
+        for (memint d = 0; d < smp.depth; d++)
+        {
+            fputs("    at ", f);
+            heap_statename(f, smp.frames[d].state);
+            if (smp.frames[d].line)
+                fprintf(f, " (%ld)", long(smp.frames[d].line));
+            fputc('\n', f);
+        }
+    }
+
+    _heapprof = on;
+}
+
+
+bool heapdump(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL)
+        return false;
+    heapdump(f);
+    fclose(f);
+    return true;
+}
+
+
+static void heap_signal(int)
+    { _heapdumpreq = 1; }
+
+
+void heapdumponsignal(int sig, const char* path)
+{
+    _heapdumppath = path;
+    signal(sig, heap_signal);
+}
+
+
+void _heap_dumpreq()
+{
+    _heapdumpreq = 0;
+    if (_heapdumppath == NULL || !heapdump(_heapdumppath))
+        heapdump(stderr);
+}
+
+
 // ------------------------------------------------------------------------- //
 
 
@@ -1336,5 +2491,8 @@ void initRuntime()
 
 void doneRuntime()
 {
+    sio.flush();
+    serr.flush();
+    internTable.clear();
 }
 
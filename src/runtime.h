@@ -8,6 +8,13 @@
 // --- charset ------------------------------------------------------------- //
 
 
+// The 16-byte scanner in charset::scan() needs SSSE3; on x86 with GCC or
+// Clang it's built regardless of the -m options and selected at run time
+#if defined(__SSSE3__) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#  define SHN_SCAN16
+#endif
+
+
 class charset
 {
 public:
@@ -24,6 +31,10 @@ protected:
 
     uchar data[BYTES];
 
+#ifdef SHN_SCAN16
+    const char* _scan16(const char*, const char*) const;
+#endif
+
 public:
     charset() throw()                              { clear(); }
     charset(const charset& s) throw()              { assign(s); }
@@ -42,9 +53,13 @@ public:
     void intersect(const charset& s);
     void invert();
     bool contains(int b) const                     { return (data[uchar(b) / 8] & (1 << (uchar(b) % 8))) != 0; }
-    bool compare(const charset& s) const           { return memcmp(data, s.data, BYTES); }
+    int compare(const charset& s) const            { return memcmp(data, s.data, BYTES); }
     bool eq(const charset& s) const                { return compare(s) == 0; }
     bool le(const charset& s) const;
+    hashint hash() const                           { return memhash(data, BYTES); }
+
+    // Returns a pointer to the first char in [p, e) not in the set, or e
+    const char* scan(const char* p, const char* e) const;
 
     charset& operator=  (const charset& s)         { assign(s); return *this; }
     charset& operator+= (const charset& s)         { unite(s); return *this; }
@@ -66,18 +81,51 @@ public:
 };
 
 
+// Returns a pointer to the first \r or \n in [p, e), or e; same as
+// (~charset("\r\n")).scan(p, e) but faster, 16 bytes at a time with SSE2 or
+// with memchr() otherwise
+const char* scaneol(const char* p, const char* e);
+
+
 // --- object -------------------------------------------------------------- //
 
 
 // object: reference-counted memory block with a virtual destructor
+// In multithreaded builds an object belongs to the thread that created it
+// and its refcount is updated with plain arithmetic, until share() switches
+// it to atomic operations. An object must be shared by its owner before
+// being passed to another thread; this is permanent.
 
 class object
 {
+    friend struct cyclecollector;
+    friend void _gc_root(object*);
+    friend void _gc_finalize(object*);
+    friend void _free_obj(object*);
+
     object(const object&) throw();
     void operator= (const object&) throw();
 
 protected:
     atomicint _refcount;
+#ifdef SHN_THR
+    bool _shared;
+#endif
+    uchar _gcflags;  // cycle collector's state, see collectcycles()
+
+    enum { GC_COLOR = 0x03, GC_BUFFERED = 0x04, GC_RTOBJ = 0x08, GC_REF = 0x10,
+        GC_TRACKED = GC_RTOBJ | GC_REF };
+
+    void _gctrack(uchar k)  { _gcflags |= k; }
+
+#ifdef SHN_THR
+
+    void _incref()          { if (_shared) pincrement(&_refcount); else ++_refcount; }
+    atomicint _decref()     { return _shared ? pdecrement(&_refcount) : --_refcount; }
+#else
+    void _incref()          { pincrement(&_refcount); }
+    atomicint _decref()     { return pdecrement(&_refcount); }
+#endif
 
     bool _release();
 
@@ -88,6 +136,8 @@ public:
         // Prevent this object from being free'd by release() and also from
         // being counted against memory leaks.
         _refcount = 1;
+        _gcflags = 0;
+        share();  // static objects are seen by all threads
 #ifdef DEBUG
         pdecrement(&object::allocated);
 #endif
@@ -96,6 +146,8 @@ public:
     void* operator new(size_t self);
     void* operator new(size_t self, memint extra);
     void  operator delete(void*);
+    // From the current arena if any, for classes whose operator new uses it
+    static void* _arena_new(size_t self);
 
     // Dirty trick that duplicates an object and hopefully preserves the
     // dynamic type (actually the VMT). Only 'self' bytes is copied; 'extra'
@@ -109,18 +161,112 @@ public:
 
     bool isunique() const       { return _refcount == 1; }
     atomicint release() throw();
-    object* grab() throw()      { pincrement(&_refcount); return this; }
+    object* grab() throw()      { _incref(); return this; }
+#ifdef SHN_THR
+    void share();
+    bool isshared() const       { return _shared; }
+#else
+    void share()                { }
+    bool isshared() const       { return false; }
+#endif
     template <class T>
         T* grab()               { object::grab(); return (T*)(this); }
     template <class T>
         void assignto(T*& p) throw() { _assignto((object*&)p); }
 
-    object() throw(): _refcount(0)  { }
+#ifdef SHN_THR
+    object() throw(): _refcount(0), _shared(false), _gcflags(0)  { }
+#else
+    object() throw(): _refcount(0), _gcflags(0)  { }
+#endif
     virtual ~object() throw();
 };
 
 
+void _free_obj(object* o);
 void _del_obj(object* o);
+void _gc_root(object* o);
+void _gc_finalize(object* o);
+
+
+// Deferred destruction: with a non-zero step, objects whose refcount drops
+// to zero are queued instead of being destroyed right away. They are then
+// destroyed iteratively by freedeferred(), up to 'max' objects at a time (all
+// if negative), including the ones released by their destructors; this
+// avoids deep recursion and long pauses on big object graphs. The VM calls
+// freedeferredstep() at safe points, i.e. on loop back-edges and at function
+// exit. Setting the step to 0 frees all queued objects. Per thread in
+// multithreaded builds.
+void deferfree(memint step);
+memint freedeferred(memint max);  // returns the number of objects freed
+void freedeferredstep();
+memint deferredcount();
+
+
+// Cycle collector: synchronous trial deletion after Bacon and Rajan. While
+// tracking is on, state objects, function pointers and references whose
+// refcount drops to a non-zero value are buffered as possible roots of
+// garbage cycles; those dropping to zero while buffered are freed by the
+// collector. collectcycles() finds the cycles reachable from the roots and
+// breaks them by clearing their objects' variables. The VM calls
+// collectcyclesstep() at safe points, which collects once enough roots are
+// buffered; scripts can call gc(). Turning tracking off collects all buffered
+// roots. In multithreaded builds each thread has its own collector, and
+// shared objects are neither buffered nor traversed.
+void trackcycles(bool);
+memint collectcycles();  // returns the number of objects reclaimed
+void collectcyclesstep();
+void cyclestats(FILE*);
+
+
+// Heap profiler: compiled in and switched on at run time. While on,
+// allocations of runtime objects are counted by kind, state objects also by
+// their State; with a non-zero period every Nth allocation is sampled along
+// with the VM call stack. heapdump() reports the counters and the sampled
+// stacks, heaviest first. A dump can also be requested by a signal, it is
+// then written at the next VM safe point: a loop back-edge or function exit.
+
+class State;  // defined in typesys.h
+
+enum HeapKind { HEAP_OBJ, HEAP_STR, HEAP_VEC, HEAP_GROW, HEAP_STATE, HEAP_CHUNK,
+    HEAP_KINDS };
+
+extern bool _heapprof;
+extern volatile int _heapdumpreq;
+void _heap_alloc(HeapKind, memint size, State*);
+void _heap_dumpreq();
+
+inline void heapalloc(HeapKind k, memint size, State* s = NULL)
+    { if (_heapprof) _heap_alloc(k, size, s); }
+inline void heapdumpstep()
+    { if (_heapdumpreq) _heap_dumpreq(); }
+
+void heapprofile(bool on, memint period = 0);
+void heapdump(FILE*);
+bool heapdump(const char* path);  // false if the file can't be created
+void heapdumponsignal(int sig, const char* path);  // path can be NULL: stderr
+
+// Call stack of the VM, maintained by the VM for the heap profiler; each
+// thread has its own.
+struct vmframe
+{
+    vmframe* prev;
+    State* state;
+    integer line;
+    vmframe(State*) throw();
+    ~vmframe() throw();
+};
+
+#ifdef SHN_THR
+extern __thread vmframe* _vmtop;
+#else
+extern vmframe* _vmtop;
+#endif
+
+inline vmframe::vmframe(State* s) throw(): prev(_vmtop), state(s), line(0)
+    { _vmtop = this; }
+inline vmframe::~vmframe() throw()
+    { _vmtop = prev; }
 
 
 #ifdef SHN_FASTER
@@ -129,9 +275,16 @@ inline atomicint object::release()
     if (this == NULL)
         return 0;
     assert(_refcount > 0);
-    atomicint r = pdecrement(&_refcount);
+    atomicint r = _decref();
     if (r == 0)
-        _del_obj(this);
+    {
+        if (_gcflags & GC_BUFFERED)
+            _gc_finalize(this);
+        else
+            _del_obj(this);
+    }
+    else if (_gcflags & GC_TRACKED)
+        _gc_root(this);
     return r;
 }
 #endif
@@ -186,7 +339,7 @@ public:
     ~rtobject() throw();
     Type* getType() const   { return _type; }
     void setType(Type* t)   { assert(_type == NULL); _type = t; }
-    void clearType() throw()    { _type = NULL; }
+    Type* clearType() throw()   { return pexchange(&_type, (Type*)NULL); }  // returns the old type
     virtual bool empty() const = 0;
     virtual void dump(fifo&) const = 0;
 };
@@ -201,6 +354,8 @@ public:
 class container: public object
 {
 protected:
+    enum { INTERNED = 0x01 };
+    uchar _flags;  // fits into object's tail padding on most platforms
     memint _capacity;
     memint _size;
     // char _data[0];
@@ -219,7 +374,7 @@ public:
 
     static memint _calc_prealloc(memint);
     container(memint cap, memint siz) throw()
-        : object(), _capacity(cap), _size(siz)  { }
+        : object(), _flags(0), _capacity(cap), _size(siz)  { }
 
     static void overflow();
     static void idxerr();
@@ -238,6 +393,8 @@ public:
         { assert(newsize > 0 && newsize <= _capacity); _size = newsize; }
     void dec_size()                 { assert(_size > 0); _size--; }
     memint capacity() const         { return _capacity; }
+    bool isinterned() const         { return _flags & INTERNED; }
+    void _setinterned()             { _flags |= INTERNED; }
 };
 
 
@@ -251,6 +408,7 @@ class bytevec
 {
     friend class variant;
     friend class CodeGen;
+    friend struct cyclecollector;
 
     friend void test_bytevec();
     friend void test_podvec();
@@ -384,10 +542,20 @@ public:
     memint find(char c) const;
     memint rfind(char c) const;
 
+    // Interning: replaces the object with the one from the global intern
+    // table so that equal interned strings share the same container and can
+    // be compared by pointer. Interned strings live until doneRuntime().
+    void intern();
+    bool isinterned() const                 { return !empty() && obj->isinterned(); }
+
+    // Hash of the string contents
+    hashint hash() const;
+
     memint compare(const char*, memint) const;
-    memint compare(const str& s) const      { return compare(s.data(), s.size()); }
+    memint compare(const str& s) const
+        { return obj.get() == s.obj.get() ? 0 : compare(s.data(), s.size()); }
     bool operator== (const char* s) const;
-    bool operator== (const str& s) const    { return compare(s.data(), s.size()) == 0; }
+    bool operator== (const str& s) const;
     bool operator== (char c) const          { return size() == 1 && *data() == c; }
     bool operator!= (const char* s) const   { return !(*this == s); }
     bool operator!= (const str& s) const    { return !(*this == s); }
@@ -469,6 +637,7 @@ public:
 
     bool empty() const                      { return parent::empty(); }
     memint size() const                     { return parent::size() / Tsize; }
+    bool isunique() const                   { return parent::_isunique(); }
     bool operator== (const podvec& v) const { return parent::operator==(v); }
     const T& operator[] (memint i) const    { return *parent::data<T>(i); }
     const T& at(memint i) const             { return *parent::at<T>(i); }
@@ -577,7 +746,7 @@ protected:
 
     public:
         static container* allocate(memint cap, memint siz) throw()
-            { return new(cap) cont(cap, siz); }
+            { heapalloc(HEAP_VEC, sizeof(cont) + cap); return new(cap) cont(cap, siz); }
 
         ~cont() throw()
             { if (_size) { finalize(data(), _size); _size = 0; } }
@@ -669,6 +838,7 @@ template <class Tkey, class Tval>
 class dict
 {
     friend class variant;
+    friend struct cyclecollector;
 
 protected:
 
@@ -979,6 +1149,10 @@ typedef set<variant> varset;
 typedef dict<variant, variant> vardict;
 
 
+#ifdef SHN_PACKVAR
+#  pragma pack(push, 4)
+#endif
+
 class variant
 {
     friend void test_variant();
@@ -1068,7 +1242,9 @@ public:
 
     memint compare(const variant&) const;
     bool operator== (const variant&) const;
+    hashint hash() const;  // consistent with operator==
     bool operator!= (const variant& v) const { return !(operator==(v)); }
+    void share() const;    // deep object::share(), see runtime.cpp
 
     Type getType() const                { return Type(type); }
     bool is(Type t) const               { return type == t; }
@@ -1127,8 +1303,16 @@ public:
 
     static void _type_err();
     static void _range_err();
+    static hashint _hashvec(const varvec&);
+    static memint _cmpvec(const varvec&, const varvec&);
+    static bool _eqvec(const varvec&, const varvec&);
+    static void _sharevec(const varvec&);
 };
 
+#ifdef SHN_PACKVAR
+#  pragma pack(pop)
+#endif
+
 
 #ifdef SHN_FASTER
 inline void variant::_init(const variant& v) throw()
@@ -1175,9 +1359,9 @@ class reference: public object
 {
 public:
     variant var;
-    reference() throw() { }
-    reference(const variant& v) throw(): var(v)  { }
-    reference(const podvar* v) throw(): var(v)  { }
+    reference() throw()                         { _gctrack(GC_REF); }
+    reference(const variant& v) throw(): var(v) { _gctrack(GC_REF); }
+    reference(const podvar* v) throw(): var(v)  { _gctrack(GC_REF); }
     ~reference() throw();
 };
 
@@ -1291,6 +1475,7 @@ const int _varsize = int(sizeof(variant));
 class fifo: public rtobject
 {
     friend void runRabbitRun(variant*, stateobj*, stateobj*, variant*, CodeSeg*);
+    friend class inbin;
 
     fifo& operator<< (bool);   // compiler traps
     fifo& operator<< (void*);
@@ -1307,6 +1492,7 @@ protected:
     static void _rdonly_err();
     static void _fifo_type_err();
     static void _token_err();
+    static void _count_err();
     void _req(bool req_char) const      { if (req_char != _is_char_fifo) _fifo_type_err(); }
     void _req_non_empty() const;
     void _req_non_empty(bool _char) const;
@@ -1319,11 +1505,17 @@ protected:
     virtual const char* get_tail();          // Get a pointer to tail data
     virtual const char* get_tail(memint*);   // ... also return the length
     virtual void deq_bytes(memint);          // Discard n consecutive bytes returned by get_tail()
+    virtual const str* get_tail_str(memint); // The str object that holds exactly the next n bytes, if any, to be shared
     virtual variant* enq_var();              // Reserve uninitialized space for a variant
     virtual void enq_char(char);             // Push one char, char fifo only
     virtual memint enq_chars(const char*, memint); // Push arbitrary number of bytes, return actual number, char fifo only
+    virtual void enq_vars(const variant*, memint); // Push copies of n variants, var fifo only
+    virtual void enq_str(const str&);        // Push a string, char fifo only; may keep a reference
 
+    bool _token_part(const char* p, memint count, memint avail, memint* total, str* result);
     void _token(const charset& chars, str* result);
+    void _line(str* result);
+    void _deq_tail(const char* p, memint count, str* result);
     void deq_var(variant*);  // dequeue variant to uninitialized area, for internal use
 
 public:
@@ -1352,6 +1544,9 @@ public:
         { int c = preview(); if (c == -1) _empty_err(); return c; }
     uchar get();
     bool get_if(char c);
+    // deq(n) and deq_vars() return at most n elements, fewer if the input
+    // ends earlier; like deq() they throw if the fifo is empty, and they also
+    // throw on a negative count. Scripts get the same with deq(f, n).
     str  deq(memint);  // CHAR_ALL, CHAR_SOME can be specified
     str  deq(const charset& c)          { str s; _token(c, &s); return s; }
     str  token(const charset& c)        { return deq(c); } // alias
@@ -1360,6 +1555,7 @@ public:
     str  line();
     bool eol();
     void skip_eol();
+    void skip_line();  // up to and including the end of line
     bool eof() const                    { return empty(); }
 
     memint enq(const char* p, memint count)  { return enq_chars(p, count); }
@@ -1370,6 +1566,10 @@ public:
     void enq(large i);
     void enq(const varvec&);
 
+    // Bulk variant dequeue: moves up to 'max' variants to the end of the
+    // vector, returns the actual number; see deq(memint) above
+    memint deq_vars(varvec&, memint max);
+
     fifo& operator<< (const char* s)    { enq(s); return *this; }
     fifo& operator<< (const str& s)     { enq(s); return *this; }
     fifo& operator<< (char c)           { enq(c); return *this; }
@@ -1387,43 +1587,76 @@ inline void variant::_init(fifo* f) throw() { _init(RTOBJ, f); }
 inline fifo* variant::_fifo() const  { return cast<fifo*>(CHKPTR(_rtobj())); }
 
 
-// The memfifo class implements a linked list of "chunks" in memory, where
-// each chunk is the size of 32 * sizeof(variant). Both enqueue and deqeue
-// operations are O(1), and memory usage is better than that of a plain linked 
-// list of elements, as "next" pointers are kept for bigger chunks of elements
-// rather than for each element. Can be used both for variants and chars. This
-// class "owns" variants, i.e. proper construction and desrtuction is done.
+class memfifo;
+
+// Called by a bounded memfifo when it's full; the handler should make room,
+// e.g. by running the consumer, or else throw. Without a handler enqueueing
+// into a full fifo throws "FIFO full".
+class fullevent: public object
+{
+public:
+    virtual void event(memfifo*) = 0;
+};
+
+
+// The memfifo class implements a linked list of "chunks" in memory. Char
+// fifos use chunks of CHAR_CHUNK_SIZE bytes; variant fifos start with chunks
+// of 32 variants and double the size while they grow, up to MAX_CHUNK_SIZE.
+// Both enqueue and deqeue operations are O(1), and memory usage is better
+// than that of a plain linked list of elements, as "next" pointers are kept
+// for bigger chunks of elements rather than for each element. Can be used
+// both for variants and chars. This class "owns" variants, i.e. proper
+// construction and desrtuction is done.
 class memfifo: public fifo
 {
 public:
 #ifdef DEBUG
     static int CHUNK_SIZE; // settable from unit tests
+    static int CHAR_CHUNK_SIZE;
 #else
-    enum { CHUNK_SIZE = 32 * _varsize };
+    enum { CHUNK_SIZE = 32 * _varsize, CHAR_CHUNK_SIZE = 4096 };
 #endif
+    // Variant fifos double their chunk size up to this limit while they grow;
+    // drained chunks are kept for reuse, up to MAX_SPARE bytes. Each time the
+    // fifo is drained, spares it didn't reuse since it was last empty are
+    // freed, so a fifo that is no longer streaming gives them back.
+    enum { MAX_CHUNK_SIZE = 1024 * _varsize, MAX_SPARE = 1024 * 1024 };
 
 protected:
     struct chunk: noncopyable
     {
         chunk* next;
+        memint size;  // keeps data aligned for variants
         char data[0];
 #ifdef DEBUG
-        chunk() throw(): next(NULL)     { pincrement(&object::allocated); }
+        chunk(memint s) throw(): next(NULL), size(s)  { pincrement(&object::allocated); }
         ~chunk() throw()                { pdecrement(&object::allocated); }
 #else
-        chunk() throw(): next(NULL)     { }
+        chunk(memint s) throw(): next(NULL), size(s)  { }
 #endif
-        void* operator new(size_t)      { return ::pmemalloc(sizeof(chunk) + CHUNK_SIZE); }
+        void* operator new(size_t, memint s)
+            { heapalloc(HEAP_CHUNK, sizeof(chunk) + s); return ::pmemalloc(sizeof(chunk) + s); }
         void operator delete(void* p)   { ::pmemfree(p); }
+        void operator delete(void* p, memint)  { ::pmemfree(p); }
     };
 
     chunk* head;    // in
     chunk* tail;    // out
+    chunk* spare;   // drained chunks, to avoid malloc churn when streaming
     int head_offs;
     int tail_offs;
+    int chunksize;  // for new chunks
+    memint sparesize;  // bytes on the spare list
+    memint sparelow;   // least sparesize since the fifo was last empty
+    memint queued;  // bytes
+    memint limit;   // bytes, 0 = unbounded
+    fullevent* onfull;
 
     void enq_chunk();
     void deq_chunk();
+    void free_spare();
+    void trim_spare();
+    void wait_room();
 
     // Overrides
     const char* get_tail();
@@ -1432,15 +1665,21 @@ protected:
     variant* enq_var();
     void enq_char(char);
     memint enq_chars(const char*, memint);
+    void enq_vars(const variant*, memint);
 
     char* enq_space(memint);
     memint enq_avail();
 
 public:
-    memfifo(Type*, bool is_char) throw();
+    memfifo(Type*, bool is_char, memint capacity = 0) throw();
     ~memfifo() throw();
 
     void clear();
+    memint size() const     { return queued / (is_char_fifo() ? 1 : _varsize); }
+    memint capacity() const { return limit / (is_char_fifo() ? 1 : _varsize); }
+    void set_chunk_size(int);   // bytes, a multiple of the variant size for variant fifos
+    void set_capacity(memint);  // in elements, 0 = unbounded
+    fullevent* set_fullevent(fullevent*);
     bool empty() const;     // override
     str get_name() const;   // override
 };
@@ -1503,6 +1742,7 @@ class strfifo: public buffifo
 protected:
     str string;
     void clear();
+    const str* get_tail_str(memint);  // override
 public:
     strfifo(Type*) throw();
     strfifo(Type*, const str&) throw();
@@ -1514,15 +1754,43 @@ public:
 };
 
 
-// TODO: varfifo, a variant vector wrapper based on buffifo
+// Variant fifo over a 'varvec'. Elements are moved out of the vector as they
+// are dequeued if the vector is unique, or copied if it's shared, so reading
+// never copies the vector itself; enqueued elements are appended to the
+// vector in place, and all() returns it without copying if nothing has been
+// dequeued yet.
+class varfifo: public buffifo
+{
+protected:
+    varvec vector;
+    bool copying;  // the vector is shared, elements are copied rather than moved out
+    void clear();
+    const char* get_tail();             // override
+    const char* get_tail(memint*);      // override
+    void deq_bytes(memint);             // override
+public:
+    varfifo(Type*) throw();
+    varfifo(Type*, const varvec&) throw();
+    ~varfifo() throw();
+    bool empty() const;     // override
+    void flush();           // override
+    str get_name() const;   // override
+    varvec all() const;
+};
 
+// Input text file. Regular files of at least MMAP_MIN bytes are mapped into
+// memory as a whole and become a single buffer; the rest are read in chunks
+// of BUF_SIZE. Data appended to a mapped file after it was opened is read
+// in the usual way.
 class intext: public buffifo
 {
 public:
 #ifdef DEBUG
     static int BUF_SIZE; // settable from unit tests
+    static int MMAP_MIN;
 #else
     enum { BUF_SIZE = 4096 * sizeof(integer) };
+    enum { MMAP_MIN = 256 * 1024 };
 #endif
 
 protected:
@@ -1530,10 +1798,16 @@ protected:
     str  filebuf;
     int  _fd;
     bool _eof;
+    bool _bufshared;  // filebuf is referred to by a string returned by deq()
+    char* _map;
+    memint _mapsize;
 
     void error(int code); // throws esyserr
     void doopen();
     void doread();
+    bool domap(memint* readsize);
+    void unmap();
+    const str* get_tail_str(memint);  // override
 
 public:
     intext(Type*, const str& fn) throw();
@@ -1545,6 +1819,30 @@ public:
 };
 
 
+// Pending output of file fifos: strings of at least HOLD_MIN bytes are kept
+// by reference instead of being copied to the buffer, and are written along
+// with it in a single writev() call
+class outgather: noncopyable
+{
+public:
+    enum { HOLD_MIN = 4096, MAX_HELD = 8 };
+
+protected:
+    str held[MAX_HELD];
+    memint pos[MAX_HELD];   // buffer offsets the strings go at
+    int count;
+
+public:
+    outgather() throw(): count(0)  { }
+    bool empty() const              { return count == 0; }
+    bool full() const               { return count == MAX_HELD; }
+    void hold(const str& s, memint p)   { held[count] = s; pos[count] = p; count++; }
+    // Writes the buffer with the held strings, then 'extra'; returns the
+    // number of bytes written, or -errno
+    memint write(int fd, const char* buf, memint len, const char* extra = NULL, memint extralen = 0);
+};
+
+
 class outtext: public buffifo
 {
 protected:
@@ -1554,8 +1852,12 @@ protected:
     str  filebuf;
     int  _fd;
     bool _err;
+    outgather gather;
 
     void error(int code); // throws esyserr
+    void write(const char* extra, memint extralen);
+    memint enq_chars(const char*, memint);  // override
+    void enq_str(const str&);               // override
 
 public:
     outtext(Type*, const str& fn) throw();
@@ -1568,15 +1870,33 @@ public:
 
 
 // Standard input/output object, a two-way fifo. In case of stderr it is write-only.
+// Output is buffered: the buffer is written when full, before reading input,
+// on flush() and on exit, and also depending on the flush mode: on newline
+// (the default for terminals), after each output call, or never. Big strings
+// are not copied to the buffer, see outgather.
 class stdfile: public intext
 {
+public:
+    enum FlushMode { FLUSH_AUTO = -1, FLUSH_FULL, FLUSH_LINE, FLUSH_ALWAYS };
+    enum { OBUF_SIZE = 2048 * sizeof(integer) };
+
 protected:
     int _ofd;
+    int _oflush;
+    memint _ohead;
+    outgather _gather;
+    char _obuf[OBUF_SIZE];
+    int flushmode();
+    void write(const char* extra, memint extralen);
     void enq_char(char);
     memint enq_chars(const char*, memint);
+    void enq_str(const str&);
 public:
-    stdfile(int infd, int outfd) throw();
+    stdfile(int infd, int outfd, FlushMode = FLUSH_AUTO) throw();
     ~stdfile() throw();
+    bool empty() const;     // override
+    void flush();           // override
+    void setflush(FlushMode m)  { _oflush = m; }
 };
 
 
@@ -1584,6 +1904,87 @@ extern stdfile sio;
 extern stdfile serr;
 
 
+// Binary variant fifos on top of a char fifo, e.g. intext and outtext. The
+// data starts with the 4-byte magic and a version byte, then each variant is
+// stored as its format tag followed by the value: ordinals as zigzag LEB128
+// varints, strings as a varint length and the bytes, vectors, sets and dicts
+// as a varint item count and the items (key/value pairs for dicts; set items
+// in ascending order), ranges as two ordinals and ordsets as a 32-byte
+// bitmap. Null objects are stored as empty ones; reals, references and
+// runtime objects can't be stored, nor can containers nested deeper than
+// MAX_DEPTH. Reading decodes one buffer of the source at a time, so files of
+// any size can be streamed.
+struct binfmt
+{
+    // Tags are part of the format and don't follow variant::Type
+    enum { NUL = 0, ORD = 1, STR = 2, RANGE = 3, VEC = 4, SET = 5, ORDSET = 6, DICT = 7 };
+    enum { VERSION = 1, MAGIC_SIZE = 4, MAX_DEPTH = 256 };
+    static const char MAGIC[MAGIC_SIZE];
+};
+
+
+class inbin: public buffifo
+{
+protected:
+    enum { BUF_VARS = 64 };
+
+    objptr<fifo> source;
+    const char* rbase;  // read window in the source's buffer
+    const char* rp;
+    const char* re;
+    str varbuf;
+    bool started;  // the header is read
+
+    static void _bin_err();
+    bool fill();
+    void commit();
+    void refill();
+    uchar getbyte()             { if (rp == re) refill(); return uchar(*rp++); }
+    uinteger getuint();
+    integer getint();
+    memint getlen();
+    void getraw(char*, memint);
+    void getitems(varvec&, int depth);
+    void getheader();
+    void getvar(variant&, int depth);
+
+public:
+    inbin(Type*, fifo* source) throw();
+    ~inbin() throw();
+    bool empty() const;     // override
+    str get_name() const;   // override
+};
+
+
+class outbin: public buffifo
+{
+protected:
+    enum { BUF_VARS = 64, OBUF_SIZE = 256 };
+
+    objptr<fifo> target;
+    memint ohead;
+    str varbuf;
+    bool started;  // the header is written
+    char obuf[OBUF_SIZE];
+
+    void putflush();
+    void putbyte(uchar c)       { if (ohead == OBUF_SIZE) putflush(); obuf[ohead++] = c; }
+    void putuint(uinteger);
+    void putint(integer);
+    void putraw(const char*, memint);
+    static bool storable(const variant&, int depth);
+    void putvar(const variant&);
+    void serialize();
+    variant* enq_var();     // override
+
+public:
+    outbin(Type*, fifo* target) throw();
+    ~outbin() throw();
+    void flush();           // override
+    str get_name() const;   // override
+};
+
+
 // System utilities
 
 
@@ -20,7 +20,16 @@ void compileEnq(Compiler* c, Builtin*)
     { c->codegen->fifoEnq(); }
 
 void compileDeq(Compiler* c, Builtin*)
-    { c->codegen->fifoDeq(); }
+{
+    // The count argument defaults to an untyped null: deq(f) vs. deq(f, n)
+    if (c->codegen->getTopType() == NULL)
+    {
+        c->codegen->undoSubexpr();
+        c->codegen->fifoDeq();
+    }
+    else
+        c->codegen->fifoDeqMany();
+}
 
 void compileToken(Compiler* c, Builtin*)
     { c->codegen->fifoToken(); }
@@ -61,11 +70,7 @@ void shn_line(variant* result, stateobj*, variant args[])
 
 void shn_skipln(variant*, stateobj*, variant args[])
 {
-    fifo* f = args[-1]._fifo();
-    int c = f->preview();
-    if (c != -1 && c != '\r' && c != '\n')
-        f->skip(non_eol_chars);
-    f->skip_eol();
+    args[-1]._fifo()->skip_line();
 }
 
 
@@ -80,3 +85,7 @@ void shn_strfifo(variant* result, stateobj*, variant args[])
 }
 
 
+void shn_gc(variant* result, stateobj*, variant[])
+{
+    new(result) variant(integer(collectcycles()));
+}
@@ -31,5 +31,7 @@ void shn_look(variant*, stateobj*, variant[]);
 
 void shn_strfifo(variant*, stateobj*, variant[]);
 
+void shn_gc(variant*, stateobj*, variant[]);
+
 
 #endif // __BUILTINS_H
@@ -866,6 +866,7 @@ bool SelfStub::canAssignTo(Type*) const
 State::State(State* par, FuncPtr* proto, State* b) throw()
     : Type(STATE), Scope(par),
       complete(false), innerObjUsed(0), outsideObjectsUsed(0),
+      recycled(NULL), recycledCount(0),
       parent(par), parentModule(getParentModule(this)),
       prototype(proto), resultVar(NULL),
       codeseg(new CodeSeg(this)), externFunc(NULL), base(b),
@@ -875,6 +876,7 @@ State::State(State* par, FuncPtr* proto, State* b) throw()
 State::State(State* par, FuncPtr* proto, ExternFuncProto func, State* b) throw()
     : Type(STATE), Scope(par),
       complete(true), innerObjUsed(0), outsideObjectsUsed(0),
+      recycled(NULL), recycledCount(0),
       parent(par), parentModule(getParentModule(this)),
       prototype(proto), resultVar(NULL),
       codeseg(), externFunc(func), base(b),
@@ -912,6 +914,12 @@ void State::_setup()
 
 State::~State() throw()
 {
+    while (recycled != NULL)
+    {
+        void* next = *(void**)recycled;
+        pmemfree(recycled);
+        recycled = next;
+    }
     args.release_all();
     innerVars.release_all();
     defs.release_all();
@@ -1097,11 +1105,34 @@ stateobj* State::newInstance()
 {
     if (varCount == 0)
         return NULL;
+    heapalloc(HEAP_STATE, sizeof(stateobj) + varCount * sizeof(variant), this);
+    if (recycled != NULL)
+    {
+        void* p = recycled;
+        recycled = *(void**)p;
+        recycledCount--;
+        return new(p) stateobj(this);
+    }
     stateobj* obj = new(varCount) stateobj(this);
     return obj;
 }
 
 
+#ifndef SHN_THR
+// Types are shared between threads and the free list is not thread-safe, so
+// multithreaded builds don't recycle
+bool State::recycleInstance(void* p)
+{
+    if (recycledCount >= STATE_RECYCLE_MAX)
+        return false;
+    *(void**)p = recycled;
+    recycled = p;
+    recycledCount++;
+    return true;
+}
+#endif
+
+
 Container* State::getContainerType(Type* idx, Type* elem)
 {
     assert(!idx->isReference());
@@ -1155,7 +1186,7 @@ FuncPtr* State::registerProto(Type* ret, Type* arg1, Type* arg2)
 
 
 Module::Module(const str& n, const str& f) throw()
-    : State(NULL, new FuncPtr(this)), filePath(f)
+    : State(NULL, new FuncPtr(this)), arena(pmemarena_new()), filePath(f)
 {
     defName = n;
     registerType(prototype);
@@ -1165,6 +1196,9 @@ Module::Module(const str& n, const str& f) throw()
 Module::~Module() throw()
 {
     codeSegs.release_all();
+    // The slabs are freed when the last object is released, which may be
+    // after the module's own members and base are destroyed
+    pmemarena_close(arena);
 }
 
 
@@ -1203,15 +1237,12 @@ void Module::registerString(str& s)
 {
     if (s.empty())
         return;
-    constStrings.push_back(s);
-    // TODO: make finding duplicates a compiler option?
-/*
+    // Interning takes care of duplicates across all modules; constStrings
+    // keeps a reference to each distinct literal used by this module.
+    s.intern();
     memint i;
-    if (constStrings.bsearch(s, i))
-        s = constStrings[i];
-    else
+    if (!constStrings.bsearch(s, i))
         constStrings.insert(i, s);
-*/
 }
 
 
@@ -1275,7 +1306,10 @@ QueenBee::QueenBee()
     addBuiltin("hi", compileHi, proto1);
     addBuiltin("_str", compileToStr, proto1);
     addBuiltin("enq", compileEnq, proto2);
-    addBuiltin("deq", compileDeq, proto1);
+    FuncPtr* protoDeq = registerProto(defVariant, NULL);
+    variant nullDefault;
+    protoDeq->addFormalArg("", NULL, false, &nullDefault);
+    addBuiltin("deq", compileDeq, protoDeq);
     addBuiltin("token", compileToken, proto2);
 
     addBuiltin("skip", compileSkip,
@@ -1292,6 +1326,9 @@ QueenBee::QueenBee()
     addTypeAlias("strfifo",
         registerState(registerProto(defCharFifo, defStr), shn_strfifo));
 
+    addBuiltin("gc", NULL,
+        registerState(registerProto(defInt), shn_gc));
+
     getCodeSeg()->close();
     setComplete();
 }
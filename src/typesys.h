@@ -72,6 +72,9 @@ public:
     Symbol(const str&, SymbolId, Type*, State*) throw();
     ~Symbol() throw();
 
+    // Symbols live as long as their module, see Module::arena
+    void* operator new(size_t s)    { return _arena_new(s); }
+
     void fqName(fifo&) const;
     void dump(fifo&) const;
 
@@ -266,6 +269,9 @@ public:
 
     ~Type() throw();
 
+    // Types, including states, live as long as their module
+    void* operator new(size_t s)    { return _arena_new(s); }
+
     bool isTypeRef() const      { return typeId == TYPEREF; }
     bool isVoid() const         { return typeId == VOID; }
     bool isVariant() const      { return typeId == VARIANT; }
@@ -553,6 +559,9 @@ typedef void (*ExternFuncProto)(variant* result, stateobj* outerobj, variant arg
 // "i" below is 1-based; arguments are numbered from right to left
 #define SHN_ARG(i) (args-(i))
 
+// Max number of released instances a state keeps for reuse
+const memint STATE_RECYCLE_MAX = 16;
+
 
 class State: public Type, public Scope
 {
@@ -573,6 +582,11 @@ protected:
     int innerObjUsed;
     int outsideObjectsUsed;
 
+    // Released instances kept for reuse by newInstance(); their variables
+    // are already zeroed by stateobj::collapse(). Linked via the first word.
+    void* recycled;
+    memint recycledCount;
+
 public:
     objvec<InnerVar> innerVars;     // owned
 
@@ -621,6 +635,9 @@ public:
     InnerVar* addInnerVar(const str&, Type*);
     InnerVar* reclaimArg(ArgVar*, Type*);
     virtual stateobj* newInstance();
+#ifndef SHN_THR
+    bool recycleInstance(void*);  // called by _free_obj()
+#endif
     template <class T>
         T* registerType(T* t) throw()
             { return cast<T*>(_registerType(t)); }
@@ -643,7 +660,7 @@ inline stateobj::stateobj(State* t) throw()
 #ifdef DEBUG
           , varcount(t->varCount)
 #endif
-        { }
+        { _gctrack(GC_RTOBJ); }
 
 
 // --- Module -------------------------------------------------------------- //
@@ -654,6 +671,7 @@ class Module: public State
 protected:
     strvec constStrings;
     objvec<CodeSeg> codeSegs;   // for dumps
+    pmemarena* arena;           // for types and symbols created while compiling
 public:
     str const filePath;
     objvec<InnerVar> usedModuleVars; // used module instances are stored in static vars
@@ -661,6 +679,7 @@ public:
     ~Module() throw();
     void dump(fifo&) const;
     str getName() const         { return defName; }
+    pmemarena* getArena() const { return arena; }
     void addUsedModule(Module*);
     InnerVar* findUsedModuleVar(Module*);
     void registerString(str&); // registers a string literal for use at run-time
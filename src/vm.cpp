@@ -127,6 +127,7 @@ void runRabbitRun(variant* result, stateobj* dataseg, stateobj* outerobj,
     State* state = codeseg->state;
     variant* argp = basep;
     stateobj* innerobj = NULL;
+    vmframe frame(state);
     
     if (state)
     {
@@ -738,6 +739,18 @@ loop:  // We use goto instead of while(1) {} so that compilers never complain
                 f._fifo()->deq_var(++stk);
             }
             break;
+        case opFifoDeqChars:
+            *(stk - 1) = (stk - 1)->_fifo()->deq(memint(stk->_int()));
+            POPPOD();
+            break;
+        case opFifoDeqVars:
+            {
+                varvec v;
+                (stk - 1)->_fifo()->deq_vars(v, memint(stk->_int()));
+                POPPOD();
+                *stk = v;
+            }
+            break;
         case opFifoCharToken:
             *(stk - 1) = (stk - 1)->_fifo()->token(stk->_ordset().get_charset());
             POP();
@@ -812,6 +825,12 @@ loop:  // We use goto instead of while(1) {} so that compilers never complain
                 // Beware of strange behavior of the GCC optimizer: this should be done in 2 steps
                 jumpoffs offs = ADV(jumpoffs);
                 ip += offs;
+                // Loop back-edges are safe points
+                if (offs < 0)
+                {
+                    freedeferredstep();
+                    heapdumpstep();
+                }
             }
             break;
         case opJumpFalse:
@@ -907,7 +926,7 @@ farMethodCall:
 
         // --- 13. DEBUGGING, DIAGNOSTICS ------------------------------------
         case opLineNum:
-            ADV(integer);
+            frame.line = ADV(integer);
             break;
         case opAssert:
             {
@@ -937,7 +956,14 @@ exit:
         if (state && !state->isCtor)
         {
             if (innerobj && !innerobj->isunique())
-                localObjErr();
+            {
+                // Pointers to nested functions released by callees may be
+                // waiting in the deferred queue
+                while (!innerobj->isunique() && freedeferred(1) > 0)
+                    ;
+                if (!innerobj->isunique())
+                    localObjErr();
+            }
 #ifdef DEBUG
             for (memint i = state->varCount; i--; )
                 POP();
@@ -948,6 +974,10 @@ exit:
             POP();
 #endif
         assert(stk == basep - 1);
+        // Function exit is a safe point
+        collectcyclesstep();
+        freedeferredstep();
+        heapdumpstep();
     }
     catch(exception&)
     {
@@ -1022,7 +1052,7 @@ void ModuleInstance::finalize()
 
 CompilerOptions::CompilerOptions() throw()
   : enableDump(true), enableAssert(true), lineNumbers(true),
-    vmListing(true), compileOnly(false), stackSize(8192)
+    vmListing(true), compileOnly(false), stackSize(8192), deferFreeStep(0)
         { modulePath.push_back("./"); }
 
 
@@ -1066,7 +1096,11 @@ Module* Context::loadModule(const str& filePath)
     objptr<Module> m = new Module(modName, filePath);
     addModule(m);
     Compiler compiler(*this, m, new intext(NULL, filePath));
-    compiler.compileModule();
+    {
+        // Types, symbols, states etc. live as long as the module
+        arenascope scope(m->getArena());
+        compiler.compileModule();
+    }
     if (options.enableDump || options.vmListing)
         dump(remove_filename_ext(filePath) + ".lst");
     return m;
@@ -1148,6 +1182,8 @@ variant Context::execute()
 
     // Run init code segments for all modules; the last one is the main program
     rtstack stack(options.stackSize);
+    deferfree(options.deferFreeStep);
+    trackcycles(true);
     try
     {
         for (memint i = 0; i < instances.size(); i++)
@@ -1161,11 +1197,15 @@ variant Context::execute()
     catch (exception&)
     {
         clear();
+        trackcycles(false);
+        deferfree(0);
         throw;
     }
 
     variant result = *queenBeeInst->obj->member(queenBee->resultVar->id);
     clear();
+    trackcycles(false);
+    deferfree(0);
     return result;
 }
 
@@ -169,6 +169,8 @@ enum OpCode
     opFifoEnqVars,      // -vec -fifo +fifo
     opFifoDeqChar,      // -fifo +char
     opFifoDeqVar,       // -fifo +char
+    opFifoDeqChars,     // -int -fifo +str
+    opFifoDeqVars,      // -int -fifo +vec
     opFifoCharToken,    // -charset -fifo +str
 
     // --- 10. ARITHMETIC
@@ -501,6 +503,7 @@ public:
     void fifoEnq();
     void fifoPush();
     void fifoDeq();
+    void fifoDeqMany();
     void fifoToken();
 
     void arithmBinary(OpCode op);
@@ -567,6 +570,7 @@ struct CompilerOptions
     bool vmListing;
     bool compileOnly;
     memint stackSize;
+    memint deferFreeStep;   // 0: free objects immediately, see deferfree()
     strvec modulePath;
 
     CompilerOptions() throw();
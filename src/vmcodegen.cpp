@@ -1176,6 +1176,19 @@ void CodeGen::fifoDeq()
 }
 
 
+void CodeGen::fifoDeqMany()
+{
+    implicitCast(queenBee->defInt, "Number of elements expected");
+    Type* fifoType = stkType(2);
+    if (!fifoType->isAnyFifo())
+        error("Fifo type expected");
+    stkPop();
+    stkPop();
+    addOp(PFifo(fifoType)->elem->deriveVec(typeReg),
+        fifoType->isByteFifo() ? opFifoDeqChars : opFifoDeqVars);
+}
+
+
 void CodeGen::fifoToken()
 {
     Type* setType = stkType();
@@ -168,6 +168,8 @@ OpInfo opTable[] =
     OP(FifoEnqVars, None),      // -vec -fifo +fifo
     OP(FifoDeqChar, None),      // -fifo +char
     OP(FifoDeqVar, None),       // -fifo +char
+    OP(FifoDeqChars, None),     // -int -fifo +str
+    OP(FifoDeqVars, None),      // -int -fifo +vec
     OP(FifoCharToken, None),    // -charset -fifo +str
 
     // --- 10. ARITHMETIC